@@ -0,0 +1,144 @@
+#ifndef CANVAS_H_
+#define CANVAS_H_
+
+#include <string.h>
+#include <iostream>
+#include <vector>
+
+#include "Geometry.h"
+
+// Fixed-size rendering. Canvas<W, H> renders a scene into a framebuffer
+// whose size is known to the compiler, so clearing, copying and printing
+// rows become fixed-length loops it can unroll and vectorise. Small HUDs
+// like a 60 x 20 overlay are the intended use.
+//
+// Static overlays built only from the literal Static* shapes below can be
+// rasterised while compiling into a constexpr StaticFrame, and then
+// used as the starting frame of a Canvas at no rasterising cost.
+
+
+// Literal counterparts of the shapes, with the same containment rules.
+// StaticCircle compares squared distances (sqrt is not constexpr), which
+// can differ from Circle::contains only for points exactly on the edge.
+struct StaticPoint {
+	Coord x, y;
+	constexpr bool contains(Coord px, Coord py) const { return px == x && py == y; }
+};
+
+struct StaticSegment {
+	Coord xmin, ymin, xmax, ymax;   // xmin == xmax or ymin == ymax
+	constexpr bool contains(Coord px, Coord py) const {
+		return px >= xmin && px <= xmax && py >= ymin && py <= ymax;
+	}
+};
+
+struct StaticRectangle {
+	Coord xmin, ymin, xmax, ymax;
+	constexpr bool contains(Coord px, Coord py) const {
+		return px >= xmin && px <= xmax && py >= ymin && py <= ymax;
+	}
+};
+
+struct StaticCircle {
+	Coord x, y, r;
+	constexpr bool contains(Coord px, Coord py) const {
+		return (px - x) * (px - x) + (py - y) * (py - y) <= r * r;
+	}
+};
+
+
+// Framebuffer laid out exactly as operator<< writes a scene: H rows of W
+// '*' or ' ' characters, each followed by '\n'
+template<int W, int H>
+struct StaticFrame {
+	char cells[(W + 1) * H];
+};
+
+namespace StaticRaster {
+	constexpr bool anyContains(Coord, Coord) {
+		return false;
+	}
+
+	template<typename First, typename... Rest>
+	constexpr bool anyContains(Coord x, Coord y, const First& first, const Rest&... rest) {
+		return first.contains(x, y) || anyContains(x, y, rest...);
+	}
+}
+
+// Rasterise shapes at compile time. Cell (b, a) holds world point
+// (b, H - a - 1), as in operator<<, and every shape is drawn.
+template<int W, int H, typename... Shapes>
+constexpr StaticFrame<W, H> rasteriseStatic(const Shapes&... shapes) {
+	StaticFrame<W, H> frame {};
+
+	for (int a = 0; a < H; a++) {
+		for (int b = 0; b < W; b++)
+			frame.cells[a * (W + 1) + b] = StaticRaster::anyContains(b, H - a - 1, shapes...) ? '*' : ' ';
+		frame.cells[a * (W + 1) + W] = '\n';
+	}
+
+	return frame;
+}
+
+
+template<int W, int H>
+class Canvas {
+
+public:
+	static constexpr int WIDTH = W;
+	static constexpr int HEIGHT = H;
+
+	Canvas() {
+		clear();
+	}
+
+	// Blank every cell
+	void clear() {
+		for (int a = 0; a < H; a++) {
+			memset(row(a), ' ', W);
+			row(a)[W] = '\n';
+		}
+	}
+
+	// Draw s on a blank frame
+	void render(const Scene& s) {
+		clear();
+		draw(s);
+	}
+
+	// Draw s on top of a precomputed frame
+	void render(const Scene& s, const StaticFrame<W, H>& background) {
+		memcpy(frame.cells, background.cells, sizeof(frame.cells));
+		draw(s);
+	}
+
+	// Characters of the frame, (W + 1) * H of them
+	const char* data() const {
+		return frame.cells;
+	}
+
+	friend std::ostream& operator<<(std::ostream& out, const Canvas& c) {
+		return out.write(c.frame.cells, sizeof(c.frame.cells));
+	}
+
+private:
+    StaticFrame<W, H> frame;
+    std::vector<Span> spans;
+
+    char* row(int a) {
+        return &frame.cells[a * (W + 1)];
+    }
+
+    // Add the covered cells of s to the frame
+    void draw(const Scene& s) {
+        RowRasteriser raster(s, W, H);
+
+        while (raster.nextRow(spans)) {
+            char* line = row(raster.row());
+            for (const Span& span: spans)
+                memset(line + span.first, '*', span.last - span.first + 1);
+        }
+    }
+};
+
+#endif /* CANVAS_H_ */
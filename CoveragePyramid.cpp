@@ -0,0 +1,200 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "CoveragePyramid.h"
+#include "Profiling.h"
+
+CoveragePyramid::CoveragePyramid(Coord left, Coord bottom, int size, int samples)
+    : left(left), bottom(bottom), size(size), samples(samples), rasterised(0) {
+    if (size < 1 || (size & (size - 1)) != 0)
+        throw std::invalid_argument("Pyramid size must be a power of two");
+    if (samples < 1 || samples > 8)
+        throw std::invalid_argument("Samples per axis must be between 1 and 8");
+
+    tile  = size < TILE ? size : TILE;
+    tiles = size / tile;
+
+    for (int n {size}; n >= 1; n /= 2)
+        levels.push_back(std::vector<float>((size_t)n * n, 0));
+}
+
+bool CoveragePyramid::tilesUnder(const BoundingBox& box, int& ti0, int& tj0, int& ti1, int& tj1) const {
+    // Cell i spans left + i - 0.5 to left + i + 0.5, and points and lines
+    // reach half a cell past their bounds. Clamp before converting, as
+    // shapes may reach far past the pyramid.
+    Coord i0 = std::max(Coord(0), std::ceil(box.xmin - left - 1));
+    Coord i1 = std::min(Coord(size - 1), std::floor(box.xmax - left + 1));
+    Coord j0 = std::max(Coord(0), std::ceil(box.ymin - bottom - 1));
+    Coord j1 = std::min(Coord(size - 1), std::floor(box.ymax - bottom + 1));
+
+    if (!(i0 <= i1 && j0 <= j1))
+        return false;
+
+    ti0 = (int)i0 / tile;
+    tj0 = (int)j0 / tile;
+    ti1 = (int)i1 / tile;
+    tj1 = (int)j1 / tile;
+
+    return true;
+}
+
+void CoveragePyramid::markDirty(const BoundingBox& box, std::vector<bool>& dirty) const {
+    int ti0, tj0, ti1, tj1;
+
+    if (tilesUnder(box, ti0, tj0, ti1, tj1))
+        for (int tj {tj0}; tj <= tj1; tj++)
+            for (int ti {ti0}; ti <= ti1; ti++)
+                dirty[tj * tiles + ti] = true;
+}
+
+void CoveragePyramid::update(const Scene& s) {
+    GEOMETRY_TRACE_SCOPE("pyramid update");
+
+    std::vector<BoundingBox> changed;
+    changes.update(s, changed);
+
+    const std::vector<const Shape*>& shapes = changes.shapes();
+    const std::vector<BoundingBox>& boxes = changes.boxes();
+
+    std::vector<bool> dirty(tiles * tiles, false);
+    for (const BoundingBox& box: changed)
+        markDirty(box, dirty);
+
+    if (std::find(dirty.begin(), dirty.end(), true) == dirty.end())
+        return;
+
+    // Hand each dirty tile the shapes that may reach it
+    std::vector<std::vector<const Shape*>> parts(tiles * tiles);
+
+    for (size_t k {0}; k < shapes.size(); k++) {
+        int ti0, tj0, ti1, tj1;
+
+        if (tilesUnder(boxes[k], ti0, tj0, ti1, tj1))
+            for (int tj {tj0}; tj <= tj1; tj++)
+                for (int ti {ti0}; ti <= ti1; ti++)
+                    if (dirty[tj * tiles + ti])
+                        parts[tj * tiles + ti].push_back(shapes[k]);
+    }
+
+    std::vector<float> coverage;
+
+    for (int tj {0}; tj < tiles; tj++) {
+        for (int ti {0}; ti < tiles; ti++) {
+            if (!dirty[tj * tiles + ti])
+                continue;
+
+            int i0 = ti * tile, j0 = tj * tile;
+
+            rasteriseCoverage(parts[tj * tiles + ti], samples, left + i0, bottom + j0 + tile - 1, 1, tile, tile, coverage);
+            rasterised++;
+
+            // The coverage rows run from the top of the tile down
+            for (int a {0}; a < tile; a++)
+                std::copy(&coverage[a * tile], &coverage[a * tile] + tile,
+                          &levels[0][(size_t)(j0 + tile - 1 - a) * size + i0]);
+
+            refresh(i0, j0, i0 + tile, j0 + tile);
+        }
+    }
+}
+
+void CoveragePyramid::refresh(int i0, int j0, int i1, int j1) {
+    for (size_t l {1}; l < levels.size(); l++) {
+        i0 /= 2;
+        j0 /= 2;
+        i1 = (i1 + 1) / 2;
+        j1 = (j1 + 1) / 2;
+
+        int n = size >> l;
+        const std::vector<float>& below = levels[l - 1];
+        std::vector<float>& level = levels[l];
+
+        for (int j {j0}; j < j1; j++)
+            for (int i {i0}; i < i1; i++) {
+                size_t k = (size_t)(2 * j) * (2 * n) + 2 * i;
+
+                level[(size_t)j * n + i] = (below[k] + below[k + 1] + below[k + 2 * n] + below[k + 2 * n + 1]) / 4;
+            }
+    }
+}
+
+void CoveragePyramid::render(std::vector<float>& coverage, Coord left, Coord top, Coord cellSize, int width, int height) const {
+    if (!(cellSize > 0))
+        throw std::invalid_argument("Cell size must be positive");
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+
+    GEOMETRY_TRACE_SCOPE("pyramid render");
+
+    size_t l {0};
+    while (l + 1 < levels.size() && (Coord)(1 << (l + 1)) <= cellSize)
+        l++;
+
+    int n = size >> l;
+    double scale = 1 << l;
+    const std::vector<float>& level = levels[l];
+
+    // Overlap of each view column (row) with the level's columns (rows),
+    // in level cells; columns and rows are independent, so work them out once
+    struct Weight {
+        int cell;
+        double weight;
+    };
+
+    auto weights = [&](double from, double to, std::vector<std::vector<Weight>>& out, int count, bool down) {
+        out.assign(count, std::vector<Weight>());
+
+        for (int c {0}; c < count; c++) {
+            double lo = down ? to - (c + 1) * cellSize : from + c * cellSize;
+            double hi = lo + cellSize;
+            double u0 = (lo - (down ? bottom : this->left) + 0.5) / scale;
+            double u1 = (hi - (down ? bottom : this->left) + 0.5) / scale;
+
+            // Clamp before converting, as the view may lie far from the pyramid
+            int k0 = (int)std::min((double)n, std::max(0.0, std::floor(u0)));
+            int k1 = (int)std::max(0.0, std::min((double)n, std::ceil(u1)));
+
+            for (int k = k0; k < k1; k++)
+                out[c].push_back(Weight { k, (std::min(u1, k + 1.0) - std::max(u0, (double)k)) / (u1 - u0) });
+        }
+    };
+
+    std::vector<std::vector<Weight>> columns, rows;
+    weights(left, 0, columns, width, false);
+    weights(0, top, rows, height, true);
+
+    coverage.assign((size_t)width * height, 0);
+
+    for (int a {0}; a < height; a++)
+        for (int b {0}; b < width; b++) {
+            double total {0};
+
+            for (const Weight& row: rows[a])
+                for (const Weight& column: columns[b])
+                    total += row.weight * column.weight * level[(size_t)row.cell * n + column.cell];
+
+            coverage[(size_t)a * width + b] = (float)total;
+        }
+}
+
+float CoveragePyramid::at(int level, int i, int j) const {
+    int n = size >> level;
+
+    if (i < 0 || j < 0 || i >= n || j >= n)
+        throw std::out_of_range("Cell outside the level");
+
+    return levels.at(level)[(size_t)j * n + i];
+}
+
+int CoveragePyramid::getSize() const {
+    return size;
+}
+
+int CoveragePyramid::getLevels() const {
+    return levels.size();
+}
+
+unsigned long CoveragePyramid::tilesRasterised() const {
+    return rasterised;
+}
@@ -0,0 +1,69 @@
+#ifndef COVERAGEPYRAMID_H_
+#define COVERAGEPYRAMID_H_
+
+#include <vector>
+#include "Geometry.h"
+
+// Mipmap of a scene's coverage for zoomed-out views. Level 0 holds the
+// supersampled covered fraction of each unit cell of a size x size square
+// of the world; each level above averages 2 x 2 cells of the one below, up
+// to a single cell. A view whose cells span many world units reads the
+// level whose cells are about as large, so it costs time in proportion to
+// the view's size, not the world's, and every world cell still counts.
+//
+// update() compares the drawn shapes' versions with those seen last time
+// and re-rasterises only the tiles under shapes that moved, changed,
+// appeared or went away, then refreshes the levels above those tiles.
+// Shapes outside the square are not drawn.
+class CoveragePyramid {
+
+public:
+	// Level 0 cell (i, j) is centred on world point (left + i, bottom + j).
+	// If size is not a power of two or samples is not between 1 and 8,
+	// throw a std::invalid_argument exception.
+	CoveragePyramid(Coord left, Coord bottom, int size, int samples = 4);
+
+	// Bring the pyramid up to date with what operator<< would draw of s.
+	// The first call rasterises everything under the scene's shapes.
+	void update(const Scene& s);
+
+	// Render a width x height view, row by row from the top, whose cell
+	// (b, a) covers world x from left + b * cellSize to left + (b + 1) *
+	// cellSize and y from top - (a + 1) * cellSize to top - a * cellSize.
+	// Each view cell is the area-weighted mean of the cells it overlaps on
+	// the level with the largest cells not bigger than it.
+	void render(std::vector<float>& coverage, Coord left, Coord top, Coord cellSize, int width, int height) const;
+
+	// Covered fraction of cell (i, j) of level (0 at the bottom)
+	float at(int level, int i, int j) const;
+
+	int getSize() const;
+	int getLevels() const;
+
+	// Level 0 tiles re-rasterised by update() so far
+	unsigned long tilesRasterised() const;
+
+	// Tiles are TILE x TILE level 0 cells (or the whole square if smaller)
+	static constexpr int TILE = 32;
+
+private:
+	Coord left, bottom;
+	int size, samples, tile, tiles;
+
+	// levels[l] holds (size >> l)^2 cells, row by row from the bottom
+	std::vector<std::vector<float>> levels;
+
+	ChangeTracker changes;
+	unsigned long rasterised;
+
+	// Range of tiles that a shape with bounds box may touch; false if none
+	bool tilesUnder(const BoundingBox& box, int& ti0, int& tj0, int& ti1, int& tj1) const;
+
+	// Flag the tiles that a shape with bounds box may touch
+	void markDirty(const BoundingBox& box, std::vector<bool>& dirty) const;
+
+	// Recompute the levels above level 0 cells [i0, i1) x [j0, j1)
+	void refresh(int i0, int j0, int i1, int j1);
+};
+
+#endif /* COVERAGEPYRAMID_H_ */
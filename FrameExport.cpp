@@ -0,0 +1,286 @@
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "FrameExport.h"
+
+
+// Append the decimal form of a non-negative n without going through a stream
+static void appendNumber(std::string& buffer, int n) {
+    char digits[12];
+    int len {0};
+    
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    
+    while (len > 0)
+        buffer += digits[--len];
+}
+
+static void appendHeader(std::string& buffer, const RowRasteriser& raster) {
+    appendNumber(buffer, raster.getWidth());
+    buffer += ' ';
+    appendNumber(buffer, raster.getHeight());
+    buffer += '\n';
+}
+
+void writeRunLength(std::ostream& out, const Scene& s, int width, int height) {
+    RowRasteriser raster(s, width, height);
+    std::vector<Span> spans;
+    std::string buffer;
+    
+    appendHeader(buffer, raster);
+    
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise run lengths");
+        
+        while (raster.nextRow(spans)) {
+            int end {0};
+            
+            for (size_t i {0}; i < spans.size(); i++) {
+                if (i > 0)
+                    buffer += ' ';
+                appendNumber(buffer, spans[i].first - end);
+                buffer += ' ';
+                appendNumber(buffer, spans[i].last - spans[i].first + 1);
+                end = spans[i].last + 1;
+            }
+            buffer += '\n';
+        }
+    }
+    
+    GEOMETRY_TRACE_SCOPE("write");
+    out.write(buffer.data(), buffer.size());
+}
+
+void writeSparse(std::ostream& out, const Scene& s, int width, int height) {
+    RowRasteriser raster(s, width, height);
+    std::vector<Span> spans;
+    std::string buffer;
+    
+    appendHeader(buffer, raster);
+    
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise sparse");
+        
+        while (raster.nextRow(spans)) {
+            for (const Span& span: spans) {
+                appendNumber(buffer, raster.row());
+                buffer += ' ';
+                appendNumber(buffer, span.first);
+                buffer += ' ';
+                appendNumber(buffer, span.last);
+                buffer += '\n';
+            }
+        }
+    }
+    
+    GEOMETRY_TRACE_SCOPE("write");
+    out.write(buffer.data(), buffer.size());
+}
+
+// Netpbm header: magic number, then width and height
+static void appendNetpbmHeader(std::string& buffer, const char* magic, int width, int height) {
+    buffer += magic;
+    buffer += '\n';
+    appendNumber(buffer, width);
+    buffer += ' ';
+    appendNumber(buffer, height);
+    buffer += '\n';
+}
+
+// Pass the buffer on once another row of rowBytes might not fit
+static void flushFor(std::ostream& out, std::string& buffer, size_t rowBytes) {
+    if (buffer.size() + rowBytes > EXPORT_BUFFER) {
+        GEOMETRY_TRACE_SCOPE("write");
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+}
+
+void writePBM(std::ostream& out, const Scene& s, int width, int height) {
+    RowRasteriser raster(s, width, height);
+    std::vector<Span> spans;
+    std::string buffer;
+    size_t rowBytes = ((size_t)width + 7) / 8;
+    
+    buffer.reserve(std::max(EXPORT_BUFFER, rowBytes + 64));
+    appendNetpbmHeader(buffer, "P4", width, height);
+    
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise PBM");
+        
+        while (raster.nextRow(spans)) {
+            flushFor(out, buffer, rowBytes);
+            
+            size_t start = buffer.size();
+            buffer.append(rowBytes, '\0');
+            unsigned char* row = reinterpret_cast<unsigned char*>(&buffer[start]);
+            
+            // Cells run from the most significant bit of each byte
+            for (const Span& span: spans) {
+                int first = span.first / 8, last = span.last / 8;
+                unsigned char head = 0xFF >> (span.first % 8), tail = 0xFF << (7 - span.last % 8);
+                
+                if (first == last) {
+                    row[first] |= head & tail;
+                    continue;
+                }
+                
+                row[first] |= head;
+                memset(row + first + 1, 0xFF, last - first - 1);
+                row[last] |= tail;
+            }
+        }
+    }
+    
+    GEOMETRY_TRACE_SCOPE("write");
+    out.write(buffer.data(), buffer.size());
+}
+
+void writePGM(std::ostream& out, const Scene& s, int samples, int width, int height) {
+    std::vector<const Shape*> shapes;
+    s.visibleShapes(shapes);
+    
+    // The canvas of renderCoverage
+    CoverageRasteriser raster(shapes, samples, 0, height - 1, 1, width, height);
+    std::vector<float> row;
+    std::string buffer;
+    
+    buffer.reserve(std::max(EXPORT_BUFFER, (size_t)width + 64));
+    appendNetpbmHeader(buffer, "P5", width, height);
+    buffer += "255\n";
+    
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise PGM");
+        
+        while (raster.nextRow(row)) {
+            flushFor(out, buffer, width);
+            
+            for (float covered: row)
+                buffer += (char)(255 - std::lround(covered * 255));
+        }
+    }
+    
+    GEOMETRY_TRACE_SCOPE("write");
+    out.write(buffer.data(), buffer.size());
+}
+
+
+// ============ FrameDiffWriter class ================
+
+// A cursor move costs about this many bytes, so shorter unchanged gaps
+// between changed cells are cheaper to rewrite than to jump over
+static constexpr int MOVE_COST = 8;
+
+FrameDiffWriter::FrameDiffWriter(int width, int height) {
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+    
+    this->width  = width;
+    this->height = height;
+    hasFrame = false;
+    
+    previous.assign(width * height, ' ');
+    current.assign(width * height, ' ');
+}
+
+void FrameDiffWriter::reset() {
+    hasFrame = false;
+}
+
+void FrameDiffWriter::moveCursor(int row, int column) {
+    // Terminal rows and columns count from 1
+    buffer += "\x1b[";
+    appendNumber(buffer, row + 1);
+    buffer += ';';
+    appendNumber(buffer, column + 1);
+    buffer += 'H';
+}
+
+void FrameDiffWriter::write(std::ostream& out, const Scene& s) {
+    RowRasteriser raster(s, width, height);
+    std::vector<Span> spans;
+    
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise frame");
+        
+        std::fill(current.begin(), current.end(), ' ');
+        while (raster.nextRow(spans)) {
+            char* row = &current[raster.row() * width];
+            for (const Span& span: spans)
+                memset(row + span.first, '*', span.last - span.first + 1);
+        }
+    }
+    
+    {
+        GEOMETRY_TRACE_SCOPE("diff");
+        
+        buffer.clear();
+        
+        if (!hasFrame) {
+            buffer += "\x1b[2J";
+            for (int a {0}; a < height; a++) {
+                moveCursor(a, 0);
+                buffer.append(&current[a * width], width);
+            }
+        }
+        else {
+            // Where the terminal cursor is after the last character written
+            int cursorRow {-1}, cursorColumn {-1};
+            
+            for (int a {0}; a < height; a++) {
+                const char* now  = &current[a * width];
+                const char* then = &previous[a * width];
+                
+                if (memcmp(now, then, width) == 0)
+                    continue;
+                
+                int b {0};
+                while (b < width) {
+                    if (now[b] == then[b]) {
+                        b++;
+                        continue;
+                    }
+                    
+                    // Extend the run over short unchanged gaps
+                    int end {b + 1}, gap {0};
+                    for (int c {b + 1}; c < width && gap < MOVE_COST; c++) {
+                        if (now[c] != then[c]) {
+                            end = c + 1;
+                            gap = 0;
+                        }
+                        else
+                            gap++;
+                    }
+                    
+                    if (cursorRow != a || cursorColumn != b)
+                        moveCursor(a, b);
+                    buffer.append(now + b, end - b);
+                    
+                    cursorRow = a;
+                    cursorColumn = end;
+                    b = end;
+                }
+            }
+            
+            if (buffer.empty())
+                return;
+        }
+    }
+    
+    // Park the cursor below the frame so other output does not land on it
+    moveCursor(height, 0);
+    
+    GEOMETRY_TRACE_SCOPE("write");
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    
+    previous.swap(current);
+    hasFrame = true;
+}
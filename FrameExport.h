@@ -0,0 +1,65 @@
+#ifndef FRAMEEXPORT_H_
+#define FRAMEEXPORT_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Geometry.h"
+
+// Compact frame formats for mostly empty canvases. Both are produced row by
+// row from a RowRasteriser, so the dense WIDTH x HEIGHT grid is never built.
+// Each starts with a "width height" header line.
+
+// One line per row holding alternating run lengths of empty and covered
+// cells, starting with an empty run (possibly 0). The trailing empty run is
+// left out, so an empty row is an empty line.
+void writeRunLength(std::ostream& out, const Scene& s, int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+// One "row first last" line per covered range of cells, top row being 0
+void writeSparse(std::ostream& out, const Scene& s, int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+
+// Binary Netpbm images, for canvases too large to view as text. Rows are
+// rasterised one at a time and passed to out through a buffer of
+// EXPORT_BUFFER bytes, so neither the image nor its file contents are ever
+// held whole. Open file streams in binary mode.
+constexpr size_t EXPORT_BUFFER = 1 << 20;
+
+// PBM ("P4"): one bit per cell, set (black) where operator<< would draw '*'
+void writePBM(std::ostream& out, const Scene& s, int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+// PGM ("P5"): one byte per cell from the coverage renderCoverage gives with
+// samples x samples points per cell, 255 for an empty cell down to 0 for a
+// covered one, so covered cells are dark as in the PBM image
+void writePGM(std::ostream& out, const Scene& s, int samples, int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+
+// Keeps a live terminal view of a scene up to date. Each frame is compared
+// with the previous one and only the changed cells are sent, as ANSI cursor
+// moves followed by the new characters, in a single write.
+class FrameDiffWriter {
+
+public:
+	FrameDiffWriter(int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+	// Bring the terminal from the previous frame to s. The first frame
+	// clears the screen and draws everything.
+	void write(std::ostream& out, const Scene& s);
+
+	// Forget the previous frame so the next write redraws the whole screen
+	void reset();
+
+private:
+    int width, height;
+    bool hasFrame;
+
+    // Frames as rows of '*' and ' ', top row first
+    std::vector<char> previous, current;
+
+    // Escape sequences and characters for one write
+    std::string buffer;
+
+    void moveCursor(int row, int column);
+};
+
+#endif /* FRAMEEXPORT_H_ */
@@ -1,22 +1,74 @@
-#include <math.h>
+#include <cmath>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
 #include <map>
+#include <thread>
+#include <unordered_map>
+#include <stdexcept>
 
 #include "Geometry.h"
+#include "MaskCache.h"
+#include "SpatialIndex.h"
 
 
 
-inline void swap(float& x, float& y) { 
-    float temp { x };
+inline void swap(Coord& x, Coord& y) { 
+    Coord temp { x };
     x = y;
     y = temp;
 }
+
+// Distance from (x, y) to the nearest point of box
+inline Coord boxDistance(const BoundingBox& box, Coord x, Coord y) {
+    Coord dx = std::max(std::max(box.xmin - x, x - box.xmax), Coord(0.0));
+    Coord dy = std::max(std::max(box.ymin - y, y - box.ymax), Coord(0.0));
+    
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+// Points, segments and rectangles are exactly their bounding boxes, so
+// their overlaps() asks the other shape whether it meets that box
+inline bool isBoxShape(const Shape& sh) {
+    return dynamic_cast<const Point*>(&sh) || dynamic_cast<const LineSegment*>(&sh) ||
+           dynamic_cast<const Rectangle*>(&sh);
+}
+
+// Sets and groups test their placed members against the other shape, which
+// rounds differently from the other way round, so a pair of them is always
+// worked out from the side at the lower address
+inline bool laterComposite(const Shape& sh, const Shape& other) {
+    return (dynamic_cast<const InstanceSet*>(&other) || dynamic_cast<const Group*>(&other)) &&
+           std::less<const Shape*>()(&other, &sh);
+}
 // ============ Shape class =================
 
+// Changes made to any shape, see Shape::changeCount
+static std::atomic<unsigned long> shapeChanges { 0 };
+
+// Last stamp handed out, see Shape::version
+static std::atomic<unsigned long> shapeStamps { 0 };
+
 Shape::Shape(int d) {
     if (d < 0)
         throw std::invalid_argument("Negative depth not allowed!");
     
     depth = d;
+    stamp = shapeStamps.fetch_add(1, std::memory_order_relaxed) + 1;
+    quiet = false;
+}
+
+Shape::Shape(const Shape& other) : depth(other.depth), stamp(other.stamp), quiet(other.quiet) {}
+
+Shape& Shape::operator=(const Shape& other) {
+    depth = other.depth;
+    stamp = other.stamp;
+    quiet = other.quiet;
+    
+    notify();
+    return *this;
 }
 
 bool Shape::setDepth(int d) {
@@ -24,6 +76,7 @@ bool Shape::setDepth(int d) {
         return false;
     
     depth = d;
+    touch();
     return true;
 }
 
@@ -31,21 +84,100 @@ int Shape::getDepth() const {
     return depth;
 }
 
+unsigned long Shape::changeCount() {
+    return shapeChanges.load(std::memory_order_relaxed);
+}
+
+unsigned long Shape::version() const {
+    return stamp;
+}
+
+bool Shape::maskKey(MaskKey&, int&, int&) const {
+    return false;
+}
+
+void Shape::watch(ShapeWatcher* w) {
+    watchers.push_back(w);
+}
+
+void Shape::unwatch(ShapeWatcher* w) {
+    auto it = std::find(watchers.begin(), watchers.end(), w);
+    if (it != watchers.end())
+        watchers.erase(it);
+}
+
+void Shape::touch() {
+    if (quiet)
+        return;
+    
+    GEOMETRY_COUNT(ShapeChanges);
+    shapeChanges.fetch_add(1, std::memory_order_relaxed);
+    stamp = shapeStamps.fetch_add(1, std::memory_order_relaxed) + 1;
+    
+    notify();
+}
+
+void Shape::notify() {
+    for (ShapeWatcher* w: watchers)
+        w->changed(*this);
+}
+
+void Shape::restamp(Shape& sh) {
+    sh.stamp = shapeStamps.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+Shape::Unrecorded::Unrecorded(Shape& sh) : sh(sh) {
+    sh.quiet = true;
+}
+
+Shape::Unrecorded::~Unrecorded() {
+    sh.quiet = false;
+}
+
+void Shape::fitSpan(Coord y, Coord x0, int count, Coord left, Coord right, std::vector<Span>& spans) const {
+    // Analytic edges may be off by a rounding step, so allow one cell of slack
+    left  = std::max(left, -Coord(1.0));
+    right = std::min(right, (Coord)count);
+    
+    if (!(left <= right))
+        return;
+    
+    int first = std::max(0, (int)std::ceil(left));
+    int last  = std::min(count - 1, (int)std::floor(right));
+    
+    while (first > 0 && contains(Vec2(x0 + (first - 1), y)))
+        first--;
+    while (first <= last && !contains(Vec2(x0 + first, y)))
+        first++;
+    while (last < count - 1 && last >= first && contains(Vec2(x0 + (last + 1), y)))
+        last++;
+    while (last >= first && !contains(Vec2(x0 + last, y)))
+        last--;
+    
+    if (first <= last)
+        spans.push_back(Span { first, last });
+}
+
+
+// =============== Vec2 struct ================
+
+Vec2::Vec2(const Point& p) : x(p.getX()), y(p.getY()) {}
+
 
 // =============== Point class ================
 
-Point::Point(float x, float y, int d) : Shape(d) {  
+Point::Point(Coord x, Coord y, int d) : Shape(d) {  
     
 
     this->distX = x;
     this->distY = y;
 }
 
-float Point::getX() const {
+Coord Point::getX() const {
     return distX;
 }
 
-float Point::getY() const {
+Coord Point::getY() const {
     return distY;
 }
 
@@ -53,7 +185,8 @@ int Point::dim() const {
     return 0;
 }
 
-void Point::translate(float x, float y) {
+void Point::translate(Coord x, Coord y) {
+    touch();
     // Increment/Decrement point's coordinate by x and y
     this->distX += x;
     this->distY += y;
@@ -62,25 +195,66 @@ void Point::translate(float x, float y) {
 void Point::rotate() {} 
 // Rotation of a point has no effect
 
-void Point::scale(float f) { 
+void Point::scale(Coord f) { 
     
 
     if (f <= 0)
         throw std::invalid_argument("Negative scale factor"); 
 }
 
-bool Point::contains(const Point& p) const {
+bool Point::contains(Vec2 p) const {
+	GEOMETRY_COUNT(PointContains);
+
 	bool res = false;
-	if(p.getX() == distX && p.getY() == distY){
+	if(p.x == distX && p.y == distY){
 		res = true;
 	}
 	return res;
 }
 
+BoundingBox Point::bounds() const {
+    return BoundingBox { distX, distY, distX, distY };
+}
+
+void Point::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    // One cell footprint centred on the point
+    unsigned char onRow = (y >= distY - Coord(0.5) && y < distY + Coord(0.5));
+    Coord left = distX - Coord(0.5), right = distX + Coord(0.5);
+
+    for (int i {0}; i < n; i++)
+        hits[i] = onRow & (xs[i] >= left) & (xs[i] < right);
+}
+
+void Point::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    if (y == distY)
+        fitSpan(y, x0, count, distX - x0, distX - x0, spans);
+}
+
+bool Point::maskKey(MaskKey& key, int& ox, int& oy) const {
+    key = MaskKey { MaskKey::PointMask, 0, 0, 0, 0, 0, 0 };
+    return MaskKey::split(distX, ox, key.a) && MaskKey::split(distY, oy, key.b);
+}
+
+bool Point::intersects(const BoundingBox& box) const {
+    return (distX >= box.xmin && distX <= box.xmax && distY >= box.ymin && distY <= box.ymax);
+}
+
+bool Point::overlaps(const Shape& other) const {
+    return other.intersects(bounds());
+}
+
+Coord Point::distanceTo(Coord x, Coord y) const {
+    return std::sqrt((x - distX) * (x - distX) + (y - distY) * (y - distY));
+}
+
+std::shared_ptr<Shape> Point::clone() const {
+    return std::make_shared<Point>(*this);
+}
+
 
 // =========== LineSegment class ==============
 
-LineSegment::LineSegment(const Point& p, const Point& q) : Shape(0) { 
+LineSegment::LineSegment(const Point& p, const Point& q) : Shape(p.getDepth()) { 
     
 
     // Exceptions
@@ -91,9 +265,6 @@ LineSegment::LineSegment(const Point& p, const Point& q) : Shape(0) {
     else if (p.getX() == q.getX() && p.getY() == q.getY())
         throw std::invalid_argument("Points conincide");
 
-    // Set depth as the points are valid
-    setDepth(p.getDepth());
-
     if (p.getX() != q.getX()) { 
         // Line parallel to Y-axis
         y1 = y2 = p.getY();
@@ -110,25 +281,27 @@ LineSegment::LineSegment(const Point& p, const Point& q) : Shape(0) {
     }
 }
 
-float LineSegment::getXmin() const {
+Coord LineSegment::getXmin() const {
     return x1;
 }
 
-float LineSegment::getXmax() const {
+Coord LineSegment::getXmax() const {
     return x2;
 }
 
-float LineSegment::getYmin() const {
+Coord LineSegment::getYmin() const {
     return y1;
 }
 
-float LineSegment::getYmax() const {
+Coord LineSegment::getYmax() const {
     return y2;
 }
 
-float LineSegment::length() const {
-    // Distance formula
-	float ans = sqrtf(powf(x2 - x1, 2) + powf(y2 - y1, 2));
+Coord LineSegment::length() const {
+    // Distance formula, squared in Coord as powf did rather than in the
+    // double std::pow promotes to
+    Coord dx = x2 - x1, dy = y2 - y1;
+	Coord ans = std::sqrt(dx * dx + dy * dy);
 	return ans;
 }
 
@@ -137,7 +310,8 @@ int LineSegment::dim() const {
     return 1;
 }
 
-void LineSegment::translate(float x, float y) {
+void LineSegment::translate(Coord x, Coord y) {
+    touch();
     // Increment/Decrement both the point's coordinates by x and y
     x1 += x;
 	y1 += y;
@@ -146,8 +320,9 @@ void LineSegment::translate(float x, float y) {
 }
 
 void LineSegment::rotate() {
-    float midX, midY;
-    float tempX, tempY;
+    touch();
+    Coord midX, midY;
+    Coord tempX, tempY;
     
     if (x1 == x2) {
         swap(x1, x2);
@@ -181,12 +356,14 @@ void LineSegment::rotate() {
 	y2 += midY;
 }
 
-void LineSegment::scale(float f) {
-    float midX, midY;
+void LineSegment::scale(Coord f) {
+    Coord midX, midY;
     
     if (f <= 0)
         throw std::invalid_argument("Negative scale factor");
     
+    touch();
+    
     midX = (x1 + x2) / 2;
     midY = (y1 + y2) / 2;
 
@@ -209,11 +386,67 @@ void LineSegment::scale(float f) {
 	y2 += midY;
 }
 
-bool LineSegment::contains(const Point& p) const {
+bool LineSegment::contains(Vec2 p) const {
+    GEOMETRY_COUNT(LineContains);
+    
     if (x1 != x2) 
-        return (p.getY() == y1 && p.getX() >= std::min(x1, x2) && p.getX() <= std::max(x1, x2));
+        return (p.y == y1 && p.x >= std::min(x1, x2) && p.x <= std::max(x1, x2));
     else     
-        return (p.getX() == x1 && p.getY() >= std::min(y1, y2) && p.getY() <= std::max(y1, y2));
+        return (p.x == x1 && p.y >= std::min(y1, y2) && p.y <= std::max(y1, y2));
+}
+
+BoundingBox LineSegment::bounds() const {
+    return BoundingBox { std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2) };
+}
+
+void LineSegment::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    // One cell wide footprint around the segment
+    BoundingBox b = bounds();
+    unsigned char onRow = (y >= b.ymin - Coord(0.5) && y < b.ymax + Coord(0.5));
+    Coord left = b.xmin - Coord(0.5), right = b.xmax + Coord(0.5);
+
+    for (int i {0}; i < n; i++)
+        hits[i] = onRow & (xs[i] >= left) & (xs[i] < right);
+}
+
+void LineSegment::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    // An axis-aligned segment contains exactly the points of its bounding box
+    BoundingBox b = bounds();
+    
+    if (y >= b.ymin && y <= b.ymax)
+        fitSpan(y, x0, count, b.xmin - x0, b.xmax - x0, spans);
+}
+
+bool LineSegment::maskKey(MaskKey& key, int& ox, int& oy) const {
+    int ex, ey;
+    key = MaskKey { MaskKey::SegmentMask, 0, 0, 0, 0, 0, 0 };
+
+    if (!MaskKey::split(x1, ox, key.a) || !MaskKey::split(y1, oy, key.b) ||
+        !MaskKey::split(x2, ex, key.c) || !MaskKey::split(y2, ey, key.d))
+        return false;
+
+    key.across = ex - ox;
+    key.up = ey - oy;
+    return true;
+}
+
+bool LineSegment::intersects(const BoundingBox& box) const {
+    BoundingBox b = bounds();
+    
+    return (b.xmin <= box.xmax && b.xmax >= box.xmin && b.ymin <= box.ymax && b.ymax >= box.ymin);
+}
+
+bool LineSegment::overlaps(const Shape& other) const {
+    // The segment is exactly its (degenerate) bounding box
+    return other.intersects(bounds());
+}
+
+Coord LineSegment::distanceTo(Coord x, Coord y) const {
+    return boxDistance(bounds(), x, y);
+}
+
+std::shared_ptr<Shape> LineSegment::clone() const {
+    return std::make_shared<LineSegment>(*this);
 }
 
 
@@ -227,14 +460,12 @@ int TwoDShape::dim() const {
 
 // ============== Rectangle class ================
 
-Rectangle::Rectangle(const Point& p, const Point& q) : TwoDShape(0) {
+Rectangle::Rectangle(const Point& p, const Point& q) : TwoDShape(p.getDepth()) {
     if (p.getDepth() != q.getDepth())
         throw std::invalid_argument("Depth mismatch");
     else if (p.getX() == q.getX() || p.getY() == q.getY())
         throw std::invalid_argument("Lines coincide");
     
-    setDepth(p.getDepth());
-    
     if (p.getX() < q.getX() && p.getY() < q.getY()) {       
         // Px < Qx, Py < Qy
         x1 = p.getX(); y1 = p.getY();
@@ -269,27 +500,46 @@ Rectangle::Rectangle(const Point& p, const Point& q) : TwoDShape(0) {
     }
 }
 
-float Rectangle::getXmin() const {
+Rectangle::Rectangle(const Rectangle& other) : TwoDShape(other) {
+    // xCoorArray and yCoorArray keep their initialisers, pointing at our own corners
+    *this = other;
+}
+
+Rectangle& Rectangle::operator=(const Rectangle& other) {
+    TwoDShape::operator=(other);
+    
+    for (size_t i {0}; i < 4; i++) {
+        *xCoorArray[i] = *other.xCoorArray[i];
+        *yCoorArray[i] = *other.yCoorArray[i];
+    }
+    
+    return *this;
+}
+
+Coord Rectangle::getXmin() const {
     return x1;
 }
 
-float Rectangle::getYmin() const {
+Coord Rectangle::getYmin() const {
     return y1;
 }
 
-float Rectangle::getXmax() const {
+Coord Rectangle::getXmax() const {
     return x3;
 }
 
-float Rectangle::getYmax() const {
+Coord Rectangle::getYmax() const {
     return y3;
 }
 
-float Rectangle::area() const {
-    return sqrtf(powf(x2 - x1, 2) + powf(y2 - y1, 2)) * sqrtf(powf(x3 - x2, 2) + powf(y3 - y2, 2));
+Coord Rectangle::area() const {
+    Coord ax = x2 - x1, ay = y2 - y1, bx = x3 - x2, by = y3 - y2;
+    
+    return std::sqrt(ax * ax + ay * ay) * std::sqrt(bx * bx + by * by);
 }
 
-void Rectangle::translate(float x, float y) {
+void Rectangle::translate(Coord x, Coord y) {
+    touch();
     for (size_t i {0}; i < 4; i++) {
         *xCoorArray[i] += x;
         *yCoorArray[i] += y;
@@ -297,7 +547,8 @@ void Rectangle::translate(float x, float y) {
 }
 
 void Rectangle::rotate() {
-    float midX, midY, xTemp, yTemp;
+    touch();
+    Coord midX, midY, xTemp, yTemp;
     
     midX = (x1 + x2) / 2;
     midY = (y1 + y4) / 2;
@@ -326,11 +577,13 @@ void Rectangle::rotate() {
 }
 
 
-void Rectangle::scale(float f) {
+void Rectangle::scale(Coord f) {
     if (f <= 0)
         throw std::invalid_argument("Negative scale factor");
+    
+    touch();
 
-    float midX, midY;
+    Coord midX, midY;
     
     midX = (x1 + x2) / 2;
     midY = (y1 + y4) / 2;
@@ -351,122 +604,2639 @@ void Rectangle::scale(float f) {
     }
 }
 
-bool Rectangle::contains(const Point& p) const {
-    return (p.getX() >= x1 && p.getX() <= x3 && p.getY() >= y1 && p.getY() <= y3);
+bool Rectangle::contains(Vec2 p) const {
+    GEOMETRY_COUNT(RectangleContains);
+    
+    return (p.x >= x1 && p.x <= x3 && p.y >= y1 && p.y <= y3);
+}
+
+BoundingBox Rectangle::bounds() const {
+    return BoundingBox { x1, y1, x3, y3 };
+}
+
+void Rectangle::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    unsigned char onRow = (y >= y1 && y <= y3);
+
+    for (int i {0}; i < n; i++)
+        hits[i] = onRow & (xs[i] >= x1) & (xs[i] <= x3);
+}
+
+void Rectangle::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    if (y >= y1 && y <= y3)
+        fitSpan(y, x0, count, x1 - x0, x3 - x0, spans);
+}
+
+bool Rectangle::maskKey(MaskKey& key, int& ox, int& oy) const {
+    int ex, ey;
+    key = MaskKey { MaskKey::RectangleMask, 0, 0, 0, 0, 0, 0 };
+
+    if (!MaskKey::split(x1, ox, key.a) || !MaskKey::split(y1, oy, key.b) ||
+        !MaskKey::split(x3, ex, key.c) || !MaskKey::split(y3, ey, key.d))
+        return false;
+
+    key.across = ex - ox;
+    key.up = ey - oy;
+    return true;
+}
+
+bool Rectangle::intersects(const BoundingBox& box) const {
+    return (x1 <= box.xmax && x3 >= box.xmin && y1 <= box.ymax && y3 >= box.ymin);
+}
+
+bool Rectangle::overlaps(const Shape& other) const {
+    return other.intersects(bounds());
+}
+
+Coord Rectangle::distanceTo(Coord x, Coord y) const {
+    return boxDistance(bounds(), x, y);
+}
+
+std::shared_ptr<Shape> Rectangle::clone() const {
+    return std::make_shared<Rectangle>(*this);
 }
 
 
 // ================== Circle class ===================
 
-Circle::Circle(const Point& c, float r) : TwoDShape(0) {
+Circle::Circle(const Point& c, Coord r) : TwoDShape(c.getDepth()) {
     if (r <= 0)
         throw std::invalid_argument("Invalid argument!");
     
-    setDepth(c.getDepth());
-    
     x = c.getX();
     y = c.getY();
     
     radius = r;
 }
 
-float Circle::getX() const {
+Coord Circle::getX() const {
     return x;
 }
 
-float Circle::getY() const {
+Coord Circle::getY() const {
     return y;
 }
 
-float Circle::getR() const {
+Coord Circle::getR() const {
     return radius;
 }
 
 
-float Circle::area() const {
+Coord Circle::area() const {
     // Area (Circle) = πr2
     return PI * (radius * radius);
 }
 
-void Circle::translate(float x, float y) {
+void Circle::translate(Coord x, Coord y) {
+    touch();
     this->x += x;
     this->y += y;
 }
 
 void Circle::rotate() { } 
 
-void Circle::scale(float f) {
+void Circle::scale(Coord f) {
     if (f <= 0)
         throw std::invalid_argument("Negative scale factor");
     
+    touch();
+    
     radius *= f;
 }
 
-bool Circle::contains(const Point& p) const {
-    float dist;
+bool Circle::contains(Vec2 p) const {
+    GEOMETRY_COUNT(CircleContains);
     
-    dist = sqrtf(powf(p.getX() - x, 2) + powf(p.getY() - y, 2));
+    Coord dist;
+    
+    Coord dx = p.x - x, dy = p.y - y;
+    dist = std::sqrt(dx * dx + dy * dy);
     
     return (dist <= radius);
 }
 
-// ================= Scene class ===================
+BoundingBox Circle::bounds() const {
+    return BoundingBox { x - radius, y - radius, x + radius, y + radius };
+}
 
-Scene::Scene() {
-    hasCustomDepth = false;
+void Circle::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    // Squared distances keep the loop free of sqrt so it vectorises
+    Coord dy2 = (y - this->y) * (y - this->y);
+    Coord r2  = radius * radius;
+
+    for (int i {0}; i < n; i++) {
+        Coord dx = xs[i] - x;
+        hits[i] = (dx * dx + dy2 <= r2);
+    }
+}
+
+void Circle::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    Coord dy = y - this->y;
     
-    drawDepth = -1;
+    if (std::fabs(dy) > radius)
+        return;
+    
+    // Half-width of the chord at height y
+    Coord half = std::sqrt(radius * radius - dy * dy);
+    
+    fitSpan(y, x0, count, x - half - x0, x + half - x0, spans);
 }
 
-void Scene::addObject(std::shared_ptr<Shape> ptr) {
-    int depth = ptr->getDepth();
+bool Circle::maskKey(MaskKey& key, int& ox, int& oy) const {
+    key = MaskKey { MaskKey::CircleMask, 0, 0, 0, 0, radius, 0 };
+    return MaskKey::split(x, ox, key.a) && MaskKey::split(y, oy, key.b);
+}
+
+bool Circle::intersects(const BoundingBox& box) const {
+    // Distance from the centre to the nearest point of the box
+    Coord dx = x - std::min(std::max(x, box.xmin), box.xmax);
+    Coord dy = y - std::min(std::max(y, box.ymin), box.ymax);
     
-    if (objectList.find(depth) != objectList.end()) {
-        objectList[depth].push_back(ptr);
-    }
-    else {
-        objectList[depth] = std::vector<std::shared_ptr<Shape>>(1, ptr);
+    return (dx * dx + dy * dy <= radius * radius);
+}
+
+bool Circle::overlaps(const Shape& other) const {
+    const Circle* c = dynamic_cast<const Circle*>(&other);
+    
+    if (c == nullptr)
+        return other.overlaps(*this);
+    
+    Coord dx = c->x - x, dy = c->y - y, reach = c->radius + radius;
+    
+    return (dx * dx + dy * dy <= reach * reach);
+}
+
+Coord Circle::distanceTo(Coord x, Coord y) const {
+    Coord dist = std::sqrt((x - this->x) * (x - this->x) + (y - this->y) * (y - this->y));
+    
+    return std::max(dist - radius, Coord(0.0));
+}
+
+std::shared_ptr<Shape> Circle::clone() const {
+    return std::make_shared<Circle>(*this);
+}
+
+// ================= Polygon class ===================
+
+// Sign of the turn from a through b to c: 1 left, -1 right, 0 in line
+static int turn(Coord ax, Coord ay, Coord bx, Coord by, Coord cx, Coord cy) {
+    Coord cross = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    
+    return (cross > 0) - (cross < 0);
+}
+
+// Check if the segments ab and cd have any point in common
+static bool segmentsMeet(Coord ax, Coord ay, Coord bx, Coord by, Coord cx, Coord cy, Coord dx, Coord dy) {
+    int abc = turn(ax, ay, bx, by, cx, cy), abd = turn(ax, ay, bx, by, dx, dy);
+    int cda = turn(cx, cy, dx, dy, ax, ay), cdb = turn(cx, cy, dx, dy, bx, by);
+    
+    if (abc == 0 && abd == 0)
+        // In line: they meet if their extents overlap
+        return std::min(ax, bx) <= std::max(cx, dx) && std::min(cx, dx) <= std::max(ax, bx) &&
+               std::min(ay, by) <= std::max(cy, dy) && std::min(cy, dy) <= std::max(ay, by);
+    
+    return abc * abd <= 0 && cda * cdb <= 0;
+}
+
+// Check if the segment ab has any point in box, by clipping it to the box
+static bool segmentMeetsBox(Coord ax, Coord ay, Coord bx, Coord by, const BoundingBox& box) {
+    Coord dx = bx - ax, dy = by - ay;
+    Coord p[4] = { -dx, dx, -dy, dy };
+    Coord q[4] = { ax - box.xmin, box.xmax - ax, ay - box.ymin, box.ymax - ay };
+    Coord t0 {0}, t1 {1};
+    
+    for (int i {0}; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0)
+                return false;
+        }
+        else if (p[i] < 0)
+            t0 = std::max(t0, q[i] / p[i]);
+        else
+            t1 = std::min(t1, q[i] / p[i]);
     }
+    
+    return t0 <= t1;
 }
 
-void Scene::setDrawDepth(int depth) {
-	if (depth < 0)
-        throw std::invalid_argument("Negative depth!");
+// Distance from (x, y) to the nearest point of the segment ab
+static Coord segmentDistance(Coord x, Coord y, Coord ax, Coord ay, Coord bx, Coord by) {
+    Coord dx = bx - ax, dy = by - ay;
+    Coord t  = ((x - ax) * dx + (y - ay) * dy) / (dx * dx + dy * dy);
     
-    hasCustomDepth = true;
+    t = std::min(std::max(t, Coord(0.0)), Coord(1.0));
     
-    drawDepth = depth;
+    Coord ex = ax + t * dx - x, ey = ay + t * dy - y;
+    
+    return std::sqrt(ex * ex + ey * ey);
 }
 
-bool CheckEmpty(const Scene& s, const Point& p) {
-   
-    for (auto P: s.objectList) {
-        for (auto listItem: P.second) {
+// Filled ranges along a line from the outline's crossings with it, given as
+// (position, winding) pairs. The crossings are sorted in place.
+template <typename T>
+static void fillRanges(std::vector<std::pair<T, int>>& crossings, FillRule rule,
+                       std::vector<std::pair<T, T>>& ranges) {
+    std::sort(crossings.begin(), crossings.end());
+    
+    int inside {0};
+    T start {0};
+    
+    for (const auto& c: crossings) {
+        int before = inside;
         
-            if (s.hasCustomDepth && s.drawDepth < listItem->getDepth())
-                    return false;
+        inside = (rule == FillRule::EvenOdd) ? inside ^ 1 : inside + c.second;
         
-            if (listItem->contains(p))
-                return true;
+        if (before == 0 && inside != 0)
+            start = c.first;
+        else if (before != 0 && inside == 0)
+            ranges.push_back(std::make_pair(start, c.first));
+    }
+}
+
+Polygon::Polygon(const std::vector<Point>& vertices, FillRule rule)
+    : TwoDShape(vertices.empty() ? 0 : vertices[0].getDepth()), rule(rule) {
+    for (const Point& v: vertices) {
+        if (v.getDepth() != vertices[0].getDepth())
+            throw std::invalid_argument("Depth mismatch");
+        
+        // Repeated vertices would make zero length sides
+        if (xs.empty() || v.getX() != xs.back() || v.getY() != ys.back()) {
+            xs.push_back(v.getX());
+            ys.push_back(v.getY());
         }
     }
     
-    return false;
+    while (xs.size() > 1 && xs.back() == xs[0] && ys.back() == ys[0]) {
+        xs.pop_back();
+        ys.pop_back();
+    }
+    
+    if (xs.size() < 3)
+        throw std::invalid_argument("Too few vertices");
+    
+    bool flat {true};
+    for (size_t i {2}; i < xs.size() && flat; i++)
+        flat = turn(xs[0], ys[0], xs[1], ys[1], xs[i], ys[i]) == 0;
+    
+    if (flat)
+        throw std::invalid_argument("Vertices in line");
+    
+    buildEdges();
 }
 
-std::ostream& operator<<(std::ostream& out, const Scene& s) {
-    for (int a {0}; a < s.HEIGHT; a++) {
-        for (int b {0}; b < s.WIDTH; b++) {
+void Polygon::buildEdges() {
+    edges.clear();
+    box = BoundingBox { xs[0], ys[0], xs[0], ys[0] };
+    
+    for (size_t i {0}; i < xs.size(); i++) {
+        size_t j = (i + 1) % xs.size();
+        
+        box.xmin = std::min(box.xmin, xs[i]);
+        box.ymin = std::min(box.ymin, ys[i]);
+        box.xmax = std::max(box.xmax, xs[i]);
+        box.ymax = std::max(box.ymax, ys[i]);
+        
+        Edge e;
+        if (ys[i] < ys[j])
+            e = Edge { ys[i], ys[j], xs[i], xs[j], 0, 1 };
+        else if (ys[i] > ys[j])
+            e = Edge { ys[j], ys[i], xs[j], xs[i], 0, -1 };
+        else
+            e = Edge { ys[i], ys[i], std::min(xs[i], xs[j]), std::max(xs[i], xs[j]), 0, 0 };
+        
+        if (e.winding != 0)
+            e.slope = (e.xtop - e.xbottom) / (e.ymax - e.ymin);
+        
+        edges.push_back(e);
+    }
+    
+    std::sort(edges.begin(), edges.end(), [](const Edge& l, const Edge& r) { return l.ymin < r.ymin; });
+}
+
+size_t Polygon::getSize() const {
+    return xs.size();
+}
+
+Coord Polygon::getX(size_t i) const {
+    return xs.at(i);
+}
+
+Coord Polygon::getY(size_t i) const {
+    return ys.at(i);
+}
+
+FillRule Polygon::getFillRule() const {
+    return rule;
+}
+
+Coord Polygon::area() const {
+    // The filled width of a row changes linearly between the heights where
+    // sides start, end or cross each other, so the midpoint of each slab
+    // between those heights measures the slab exactly
+    std::vector<Coord> heights(ys);
+    
+    for (size_t i {0}; i < edges.size(); i++)
+        for (size_t j {i + 1}; j < edges.size(); j++) {
+            const Edge& a = edges[i];
+            const Edge& b = edges[j];
             
-            Point currentPosition (b, s.HEIGHT - a - 1);
+            if (a.winding == 0 || b.winding == 0 || b.ymin >= a.ymax)
+                continue;
             
-            if (CheckEmpty(s, currentPosition))
-                out << '*';
-            else
-                out << ' ';
+            // Where the sides' x-coordinates, linear in y, are equal
+            Coord lo = std::max(a.ymin, b.ymin), hi = std::min(a.ymax, b.ymax);
+            Coord gapLo = a.xAt(lo) - b.xAt(lo), gapHi = a.xAt(hi) - b.xAt(hi);
+            
+            if ((gapLo < 0) != (gapHi < 0) && gapLo != 0 && gapHi != 0)
+                heights.push_back(lo + (hi - lo) * gapLo / (gapLo - gapHi));
         }
-        out << std::endl;
+    
+    std::sort(heights.begin(), heights.end());
+    heights.erase(std::unique(heights.begin(), heights.end()), heights.end());
+    
+    std::vector<std::pair<Coord, Coord>> ranges;
+    double total {0};
+    
+    for (size_t i {1}; i < heights.size(); i++) {
+        ranges.clear();
+        rowRanges((heights[i - 1] + heights[i]) / 2, ranges);
+        
+        for (const auto& r: ranges)
+            total += (double)(r.second - r.first) * (heights[i] - heights[i - 1]);
     }
     
-	return out;
+    return total;
+}
+
+void Polygon::translate(Coord x, Coord y) {
+    touch();
+    
+    for (size_t i {0}; i < xs.size(); i++) {
+        xs[i] += x;
+        ys[i] += y;
+    }
+    
+    buildEdges();
+}
+
+void Polygon::rotate() {
+    touch();
+    
+    Coord midX = (box.xmin + box.xmax) / 2;
+    Coord midY = (box.ymin + box.ymax) / 2;
+    
+    // Quarter turn anticlockwise, as Rectangle::rotate
+    for (size_t i {0}; i < xs.size(); i++) {
+        Coord xTemp = xs[i] - midX, yTemp = ys[i] - midY;
+        
+        xs[i] = midX - yTemp;
+        ys[i] = midY + xTemp;
+    }
+    
+    buildEdges();
+}
+
+void Polygon::scale(Coord f) {
+    if (f <= 0)
+        throw std::invalid_argument("Negative scale factor");
+    
+    touch();
+    
+    Coord midX = (box.xmin + box.xmax) / 2;
+    Coord midY = (box.ymin + box.ymax) / 2;
+    
+    for (size_t i {0}; i < xs.size(); i++) {
+        xs[i] = midX + (xs[i] - midX) * f;
+        ys[i] = midY + (ys[i] - midY) * f;
+    }
+    
+    buildEdges();
+}
+
+bool Polygon::contains(Vec2 p) const {
+    GEOMETRY_COUNT(PolygonContains);
+    
+    Coord px = p.x, py = p.y;
+    
+    if (px < box.xmin || px > box.xmax || py < box.ymin || py > box.ymax)
+        return false;
+    
+    // Count the sides crossing the row to the right of p, each side holding
+    // its lower end but not its upper one so shared vertices count once
+    int inside {0};
+    
+    for (const Edge& e: edges) {
+        if (e.ymin > py)
+            break;
+        if (e.ymax < py)
+            continue;
+        
+        if (e.winding == 0) {
+            if (px >= e.xbottom && px <= e.xtop)
+                return true;
+            continue;
+        }
+        
+        Coord x = e.xAt(py);
+        
+        // Points on the outline are inside, as for the other shapes
+        if (x == px)
+            return true;
+        
+        if (x > px && py < e.ymax)
+            inside = (rule == FillRule::EvenOdd) ? inside ^ 1 : inside + e.winding;
+    }
+    
+    return inside != 0;
+}
+
+BoundingBox Polygon::bounds() const {
+    return box;
+}
+
+void Polygon::rowRanges(Coord y, std::vector<std::pair<Coord, Coord>>& ranges) const {
+    static thread_local std::vector<std::pair<Coord, int>> crossings;
+    
+    crossings.clear();
+    ranges.clear();
+    
+    for (const Edge& e: edges) {
+        if (e.ymin > y)
+            break;
+        if (e.winding != 0 && y < e.ymax)
+            crossings.push_back(std::make_pair(e.xAt(y), e.winding));
+    }
+    
+    fillRanges(crossings, rule, ranges);
+}
+
+void Polygon::columnRanges(double x, std::vector<std::pair<double, double>>& ranges) const {
+    std::vector<std::pair<double, int>> crossings;
+    
+    for (size_t i {0}; i < xs.size(); i++) {
+        size_t j = (i + 1) % xs.size();
+        double xa = xs[i], ya = ys[i], xb = xs[j], yb = ys[j];
+        
+        // Same half-open rule as the rows, with x in place of y
+        if ((xa <= x && x < xb) || (xb <= x && x < xa))
+            crossings.push_back(std::make_pair(ya + (x - xa) / (xb - xa) * (yb - ya), xa < xb ? 1 : -1));
+    }
+    
+    fillRanges(crossings, rule, ranges);
+}
+
+void Polygon::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    static thread_local std::vector<std::pair<Coord, Coord>> ranges;
+    
+    if (y < box.ymin || y > box.ymax)
+        ranges.clear();
+    else
+        rowRanges(y, ranges);
+    
+    for (int i {0}; i < n; i++) {
+        unsigned char hit {0};
+        
+        for (const auto& r: ranges)
+            hit |= (xs[i] >= r.first) & (xs[i] <= r.second);
+        
+        hits[i] = hit;
+    }
+}
+
+void Polygon::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    static thread_local std::vector<std::pair<Coord, Coord>> ranges;
+    
+    if (y < box.ymin || y > box.ymax)
+        return;
+    
+    rowRanges(y, ranges);
+    
+    // Vertices and horizontal sides on the row belong to the outline but
+    // may lie outside every filled range
+    for (const Edge& e: edges) {
+        if (e.ymin > y)
+            break;
+        
+        if (e.winding == 0) {
+            if (e.ymax == y)
+                ranges.push_back(std::make_pair(e.xbottom, e.xtop));
+        }
+        else if (e.ymin == y)
+            ranges.push_back(std::make_pair(e.xbottom, e.xbottom));
+        else if (e.ymax == y)
+            ranges.push_back(std::make_pair(e.xtop, e.xtop));
+    }
+    
+    std::sort(ranges.begin(), ranges.end());
+    
+    Coord lo {0}, hi {0};
+    bool open {false};
+    
+    for (const auto& r: ranges) {
+        if (open && r.first <= hi)
+            hi = std::max(hi, r.second);
+        else {
+            if (open)
+                fitSpan(y, x0, count, lo - x0, hi - x0, spans);
+            lo = r.first;
+            hi = r.second;
+            open = true;
+        }
+    }
+    
+    if (open)
+        fitSpan(y, x0, count, lo - x0, hi - x0, spans);
+}
+
+bool Polygon::intersects(const BoundingBox& box) const {
+    const BoundingBox& b = this->box;
+    
+    if (b.xmin > box.xmax || b.xmax < box.xmin || b.ymin > box.ymax || b.ymax < box.ymin)
+        return false;
+    
+    // Either a side reaches into the box or the box lies wholly inside
+    for (size_t i {0}; i < xs.size(); i++) {
+        size_t j = (i + 1) % xs.size();
+        
+        if (segmentMeetsBox(xs[i], ys[i], xs[j], ys[j], box))
+            return true;
+    }
+    
+    return contains(Vec2(box.xmin, box.ymin));
+}
+
+bool Polygon::overlaps(const Shape& other) const {
+    const Polygon* poly = dynamic_cast<const Polygon*>(&other);
+    const Circle* circle = dynamic_cast<const Circle*>(&other);
+    
+    if (poly != nullptr) {
+        if (!other.intersects(box))
+            return false;
+        
+        for (size_t i {0}; i < xs.size(); i++) {
+            size_t j = (i + 1) % xs.size();
+            
+            for (size_t k {0}; k < poly->xs.size(); k++) {
+                size_t l = (k + 1) % poly->xs.size();
+                
+                if (segmentsMeet(xs[i], ys[i], xs[j], ys[j], poly->xs[k], poly->ys[k], poly->xs[l], poly->ys[l]))
+                    return true;
+            }
+        }
+        
+        // Outlines apart: one is wholly inside the other or they are disjoint
+        return contains(Vec2(poly->xs[0], poly->ys[0])) || poly->contains(Vec2(xs[0], ys[0]));
+    }
+    
+    if (circle != nullptr)
+        return distanceTo(circle->getX(), circle->getY()) <= circle->getR();
+    
+    // Sets and groups test their placed members against the polygon
+    if (isBoxShape(other))
+        return intersects(other.bounds());
+    
+    return other.overlaps(*this);
+}
+
+Coord Polygon::distanceTo(Coord x, Coord y) const {
+    if (contains(Vec2(x, y)))
+        return 0;
+    
+    Coord best = segmentDistance(x, y, xs.back(), ys.back(), xs[0], ys[0]);
+    
+    for (size_t i {1}; i < xs.size(); i++)
+        best = std::min(best, segmentDistance(x, y, xs[i - 1], ys[i - 1], xs[i], ys[i]));
+    
+    return best;
+}
+
+std::shared_ptr<Shape> Polygon::clone() const {
+    return std::make_shared<Polygon>(*this);
+}
+
+// =============== InstanceSet class =================
+
+InstanceSet::InstanceSet(const Shape& prototype, const std::vector<Instance>& instances, int d)
+    : Shape(d), prototype(prototype.clone()), instances(instances) {
+    if (instances.empty())
+        throw std::invalid_argument("No instances");
+    
+    for (Instance& in: this->instances) {
+        if (in.factor <= 0)
+            throw std::invalid_argument("Negative scale factor");
+        
+        in.turns = ((in.turns % 4) + 4) % 4;
+    }
+    
+    BoundingBox b = prototype.bounds();
+    
+    cx = (b.xmin + b.xmax) / 2;
+    cy = (b.ymin + b.ymax) / 2;
+    halfWidth  = (b.xmax - b.xmin) / 2;
+    halfHeight = (b.ymax - b.ymin) / 2;
+    
+    buildBounds();
+}
+
+size_t InstanceSet::getSize() const {
+    return instances.size();
+}
+
+const Instance& InstanceSet::getInstance(size_t i) const {
+    return instances.at(i);
+}
+
+const Shape& InstanceSet::getPrototype() const {
+    return *prototype;
+}
+
+std::shared_ptr<Shape> InstanceSet::place(size_t i) const {
+    std::shared_ptr<Shape> sh = scratch(i);
+    restamp(*sh);
+    return sh;
+}
+
+std::shared_ptr<Shape> InstanceSet::scratch(size_t i) const {
+    const Instance& in = instances.at(i);
+    std::shared_ptr<Shape> sh = prototype->clone();
+    Unrecorded fresh(*sh);
+    
+    sh->setDepth(getDepth());
+    sh->scale(in.factor);
+    for (int t {0}; t < in.turns; t++)
+        sh->rotate();
+    sh->translate(in.x, in.y);
+    
+    return sh;
+}
+
+BoundingBox InstanceSet::placedBounds(const Instance& in) const {
+    Coord w = halfWidth * in.factor, h = halfHeight * in.factor;
+    
+    if (in.turns % 2)
+        swap(w, h);
+    
+    return BoundingBox { cx + in.x - w, cy + in.y - h, cx + in.x + w, cy + in.y + h };
+}
+
+Vec2 InstanceSet::toPrototype(const Instance& in, Vec2 p) const {
+    // Placements that are only moved subtract the offset alone, so rowSpans
+    // can hand the same positions to the prototype
+    if (in.factor == 1 && in.turns == 0)
+        return Vec2(p.x - in.x, p.y - in.y);
+    
+    Coord dx = (p.x - in.x - cx) / in.factor, dy = (p.y - in.y - cy) / in.factor;
+    
+    // Undo the quarter turns anticlockwise, (x, y) -> (-y, x)
+    switch (in.turns) {
+    case 1:  return Vec2(cx + dy, cy - dx);
+    case 2:  return Vec2(cx - dx, cy - dy);
+    case 3:  return Vec2(cx - dy, cy + dx);
+    default: return Vec2(cx + dx, cy + dy);
+    }
+}
+
+void InstanceSet::buildBounds() {
+    auto lower = [this](const Instance& l, const Instance& r) {
+        return placedBounds(l).ymin < placedBounds(r).ymin;
+    };
+    
+    if (!std::is_sorted(instances.begin(), instances.end(), lower))
+        std::sort(instances.begin(), instances.end(), lower);
+    
+    box = placedBounds(instances[0]);
+    tallest = 0;
+    reach = Coord(0.5);
+    
+    for (const Instance& in: instances) {
+        BoundingBox b = placedBounds(in);
+        
+        box.xmin = std::min(box.xmin, b.xmin);
+        box.ymin = std::min(box.ymin, b.ymin);
+        box.xmax = std::max(box.xmax, b.xmax);
+        box.ymax = std::max(box.ymax, b.ymax);
+        
+        tallest = std::max(tallest, b.ymax - b.ymin);
+    }
+}
+
+void InstanceSet::placementsIn(Coord ylo, Coord yhi, size_t& first, size_t& last) const {
+    auto below = [this](const Instance& in, Coord y) { return placedBounds(in).ymin < y; };
+    auto above = [this](Coord y, const Instance& in) { return y < placedBounds(in).ymin; };
+    
+    first = std::lower_bound(instances.begin(), instances.end(), ylo - tallest, below) - instances.begin();
+    last  = std::upper_bound(instances.begin() + first, instances.end(), yhi, above) - instances.begin();
+}
+
+int InstanceSet::dim() const {
+    return prototype->dim();
+}
+
+void InstanceSet::translate(Coord x, Coord y) {
+    touch();
+    
+    for (Instance& in: instances) {
+        in.x += x;
+        in.y += y;
+    }
+    
+    buildBounds();
+}
+
+void InstanceSet::rotate() {
+    touch();
+    
+    Coord midX = (box.xmin + box.xmax) / 2;
+    Coord midY = (box.ymin + box.ymax) / 2;
+    
+    // Turn each placement's centre about the set's centre, and the
+    // placement itself about its own centre
+    for (Instance& in: instances) {
+        Coord xTemp = cx + in.x - midX, yTemp = cy + in.y - midY;
+        
+        in.x = midX - yTemp - cx;
+        in.y = midY + xTemp - cy;
+        in.turns = (in.turns + 1) % 4;
+    }
+    
+    buildBounds();
+}
+
+void InstanceSet::scale(Coord f) {
+    if (f <= 0)
+        throw std::invalid_argument("Negative scale factor");
+    
+    touch();
+    
+    Coord midX = (box.xmin + box.xmax) / 2;
+    Coord midY = (box.ymin + box.ymax) / 2;
+    
+    for (Instance& in: instances) {
+        in.x = midX + (cx + in.x - midX) * f - cx;
+        in.y = midY + (cy + in.y - midY) * f - cy;
+        in.factor *= f;
+    }
+    
+    buildBounds();
+}
+
+bool InstanceSet::contains(Vec2 p) const {
+    if (p.y < box.ymin || p.y > box.ymax)
+        return false;
+    
+    size_t first, last;
+    placementsIn(p.y, p.y, first, last);
+    
+    for (size_t i {first}; i < last; i++) {
+        const Instance& in = instances[i];
+        BoundingBox b = placedBounds(in);
+        
+        if (p.y < b.ymin || p.y > b.ymax)
+            continue;
+        
+        // Placed bounds are rounded, so placements that are only moved leave
+        // the columns to the prototype, as rowSpans does
+        bool moved = in.factor == 1 && in.turns == 0;
+        
+        if ((moved || (p.x >= b.xmin && p.x <= b.xmax)) && prototype->contains(toPrototype(in, p)))
+            return true;
+    }
+    
+    return false;
+}
+
+BoundingBox InstanceSet::bounds() const {
+    return box;
+}
+
+void InstanceSet::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    // Not shared scratch space, since the prototype may be a set itself
+    std::vector<Coord> shifted;
+    std::vector<unsigned char> placedHits;
+    
+    std::fill(hits, hits + n, 0);
+    
+    // Points and segments reach half a unit past their bounds
+    size_t first, last;
+    placementsIn(y - reach, y + reach, first, last);
+    
+    for (size_t j {first}; j < last; j++) {
+        const Instance& in = instances[j];
+        BoundingBox b = placedBounds(in);
+        
+        if (y < b.ymin - reach || y > b.ymax + reach)
+            continue;
+        
+        if (in.factor == 1 && in.turns == 0) {
+            shifted.resize(n);
+            placedHits.resize(n);
+            
+            for (int i {0}; i < n; i++)
+                shifted[i] = xs[i] - in.x;
+            
+            prototype->sampleRow(&shifted[0], n, y - in.y, &placedHits[0]);
+            
+            for (int i {0}; i < n; i++)
+                hits[i] |= placedHits[i];
+            continue;
+        }
+        
+        // Scaling would scale the footprints of points and segments too, so
+        // sample the placed copy
+        if (in.factor != 1) {
+            placedHits.resize(n);
+            scratch(j)->sampleRow(xs, n, y, &placedHits[0]);
+            
+            for (int i {0}; i < n; i++)
+                hits[i] |= placedHits[i];
+            continue;
+        }
+        
+        // Turned rows run along the prototype's columns, so map each sample
+        for (int i {0}; i < n; i++) {
+            if (hits[i] || xs[i] < b.xmin - reach || xs[i] > b.xmax + reach)
+                continue;
+            
+            Vec2 v = toPrototype(in, Vec2(xs[i], y));
+            prototype->sampleRow(&v.x, 1, v.y, &hits[i]);
+        }
+    }
+}
+
+void InstanceSet::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    if (y < box.ymin || y > box.ymax)
+        return;
+    
+    size_t first, last;
+    placementsIn(y, y, first, last);
+    
+    for (size_t i {first}; i < last; i++) {
+        const Instance& in = instances[i];
+        BoundingBox b = placedBounds(in);
+        
+        if (y < b.ymin || y > b.ymax)
+            continue;
+        
+        if (in.factor == 1 && in.turns == 0) {
+            prototype->rowSpans(y - in.y, x0 - in.x, count, spans);
+            continue;
+        }
+        
+        // Otherwise test the cells under the placement one by one
+        Coord lo = std::max(Coord(0), std::ceil(b.xmin - x0));
+        Coord hi = std::min(Coord(count - 1), std::floor(b.xmax - x0));
+        
+        if (!(lo <= hi))
+            continue;
+        
+        int left = (int)lo, right = (int)hi;
+        
+        for (int k {left}; k <= right; k++) {
+            if (!prototype->contains(toPrototype(in, Vec2(x0 + k, y))))
+                continue;
+            
+            if (!spans.empty() && spans.back().last == k - 1)
+                spans.back().last = k;
+            else
+                spans.push_back(Span { k, k });
+        }
+    }
+}
+
+bool InstanceSet::intersects(const BoundingBox& box) const {
+    size_t first, last;
+    placementsIn(box.ymin, box.ymax, first, last);
+    
+    for (size_t i {first}; i < last; i++) {
+        const Instance& in = instances[i];
+        BoundingBox b = placedBounds(in);
+        
+        if (b.xmin > box.xmax || b.xmax < box.xmin || b.ymin > box.ymax || b.ymax < box.ymin)
+            continue;
+        
+        // Quarter turns keep boxes axis-aligned, so the box maps to a box
+        Vec2 p = toPrototype(in, Vec2(box.xmin, box.ymin));
+        Vec2 q = toPrototype(in, Vec2(box.xmax, box.ymax));
+        
+        if (prototype->intersects(BoundingBox { std::min(p.x, q.x), std::min(p.y, q.y),
+                                                std::max(p.x, q.x), std::max(p.y, q.y) }))
+            return true;
+    }
+    
+    return false;
+}
+
+bool InstanceSet::overlaps(const Shape& other) const {
+    BoundingBox o = other.bounds();
+    
+    // Answer as other.overlaps(*this) would, rather than testing placed
+    // copies that round differently
+    if (isBoxShape(other))
+        return intersects(o);
+    
+    if (laterComposite(*this, other))
+        return other.overlaps(*this);
+    
+    size_t first, last;
+    placementsIn(o.ymin, o.ymax, first, last);
+    
+    for (size_t i {first}; i < last; i++) {
+        BoundingBox b = placedBounds(instances[i]);
+        
+        if (b.xmin > o.xmax || b.xmax < o.xmin || b.ymin > o.ymax || b.ymax < o.ymin)
+            continue;
+        
+        if (other.overlaps(*scratch(i)))
+            return true;
+    }
+    
+    return false;
+}
+
+Coord InstanceSet::distanceTo(Coord x, Coord y) const {
+    Coord best = std::numeric_limits<Coord>::max();
+    
+    for (const Instance& in: instances) {
+        if (boxDistance(placedBounds(in), x, y) >= best)
+            continue;
+        
+        // Quarter turns keep distances and scaling scales them
+        Vec2 v = toPrototype(in, Vec2(x, y));
+        best = std::min(best, prototype->distanceTo(v.x, v.y) * in.factor);
+    }
+    
+    return best;
+}
+
+std::shared_ptr<Shape> InstanceSet::clone() const {
+    return std::make_shared<InstanceSet>(*this);
+}
+
+// ================== Group class ===================
+
+Group::Group(int d) : Shape(d), x(0), y(0), factor(1), turns(0), local { 0, 0, 0, 0 }, localAt(0), localValid(false) {}
+
+Group::Group(const Group& other) : Shape(other), x(other.x), y(other.y), factor(other.factor), turns(other.turns) {
+    for (const auto& child: other.children) {
+        children.push_back(child->clone());
+        children.back()->watch(this);
+    }
+    
+    // The clones have the same geometry, so the cached bounds still hold
+    std::lock_guard<std::mutex> hold(other.localLock);
+    local = other.local;
+    localAt = other.localAt;
+    localValid = other.localValid;
+}
+
+Group::~Group() {
+    for (const auto& child: children)
+        child->unwatch(this);
+}
+
+void Group::addChild(std::shared_ptr<Shape> child) {
+    if (child == nullptr || child.get() == this)
+        throw std::invalid_argument("Invalid child");
+    
+    touch();
+    children.push_back(child);
+    child->watch(this);
+    
+    // The new child may be older than the others, so its version alone
+    // does not mark the cached bounds stale
+    std::lock_guard<std::mutex> hold(localLock);
+    localValid = false;
+}
+
+size_t Group::getSize() const {
+    return children.size();
+}
+
+std::shared_ptr<Shape> Group::getChild(size_t i) const {
+    return children.at(i);
+}
+
+std::shared_ptr<Shape> Group::place(size_t i) const {
+    std::shared_ptr<Shape> sh = scratch(i);
+    restamp(*sh);
+    return sh;
+}
+
+std::shared_ptr<Shape> Group::scratch(size_t i) const {
+    std::shared_ptr<Shape> sh = children.at(i)->clone();
+    Unrecorded fresh(*sh);
+    BoundingBox b = sh->bounds();
+    Vec2 centre((b.xmin + b.xmax) / 2, (b.ymin + b.ymax) / 2);
+    Vec2 moved = toWorld(centre);
+    
+    // Scaling and turning about the child's centre, then moving that
+    // centre to where the transform takes it, applies the transform
+    sh->setDepth(getDepth());
+    sh->scale(factor);
+    for (int t {0}; t < turns; t++)
+        sh->rotate();
+    sh->translate(moved.x - centre.x, moved.y - centre.y);
+    
+    return sh;
+}
+
+Vec2 Group::toLocal(Vec2 p) const {
+    Coord dx = p.x - x, dy = p.y - y;
+    
+    if (factor == 1 && turns == 0)
+        return Vec2(dx, dy);
+    
+    dx /= factor;
+    dy /= factor;
+    
+    // Undo the quarter turns anticlockwise, (x, y) -> (-y, x)
+    switch (turns) {
+    case 1:  return Vec2(dy, -dx);
+    case 2:  return Vec2(-dx, -dy);
+    case 3:  return Vec2(-dy, dx);
+    default: return Vec2(dx, dy);
+    }
+}
+
+Vec2 Group::toWorld(Vec2 v) const {
+    Coord vx = v.x * factor, vy = v.y * factor;
+    
+    switch (turns) {
+    case 1:  return Vec2(x - vy, y + vx);
+    case 2:  return Vec2(x - vx, y - vy);
+    case 3:  return Vec2(x + vy, y - vx);
+    default: return Vec2(x + vx, y + vy);
+    }
+}
+
+BoundingBox Group::localBounds() const {
+    // Stamps only grow, so any change to a child raises the latest one
+    unsigned long now {0};
+    for (const auto& child: children)
+        now = std::max(now, child->version());
+    
+    std::lock_guard<std::mutex> hold(localLock);
+    
+    if (!localValid || localAt != now) {
+        for (size_t i {0}; i < children.size(); i++) {
+            BoundingBox b = children[i]->bounds();
+            
+            if (i == 0)
+                local = b;
+            
+            local.xmin = std::min(local.xmin, b.xmin);
+            local.ymin = std::min(local.ymin, b.ymin);
+            local.xmax = std::max(local.xmax, b.xmax);
+            local.ymax = std::max(local.ymax, b.ymax);
+        }
+        
+        localAt = now;
+        localValid = true;
+    }
+    
+    return local;
+}
+
+unsigned long Group::version() const {
+    unsigned long v = Shape::version();
+    
+    for (const auto& child: children)
+        v = std::max(v, child->version());
+    
+    return v;
+}
+
+int Group::dim() const {
+    int d {0};
+    
+    for (const auto& child: children)
+        d = std::max(d, child->dim());
+    
+    return d;
+}
+
+void Group::translate(Coord x, Coord y) {
+    touch();
+    this->x += x;
+    this->y += y;
+}
+
+void Group::rotate() {
+    BoundingBox b = bounds();
+    Coord midX = (b.xmin + b.xmax) / 2, midY = (b.ymin + b.ymax) / 2;
+    Coord xTemp = x - midX, yTemp = y - midY;
+    
+    touch();
+    
+    // Turn the origin of the group's frame about the centre as well
+    x = midX - yTemp;
+    y = midY + xTemp;
+    turns = (turns + 1) % 4;
+}
+
+void Group::scale(Coord f) {
+    if (f <= 0)
+        throw std::invalid_argument("Negative scale factor");
+    
+    BoundingBox b = bounds();
+    Coord midX = (b.xmin + b.xmax) / 2, midY = (b.ymin + b.ymax) / 2;
+    
+    touch();
+    
+    x = midX + (x - midX) * f;
+    y = midY + (y - midY) * f;
+    factor *= f;
+}
+
+bool Group::contains(Vec2 p) const {
+    BoundingBox b = bounds();
+    
+    if (p.x < b.xmin || p.x > b.xmax || p.y < b.ymin || p.y > b.ymax)
+        return false;
+    
+    Vec2 v = toLocal(p);
+    
+    for (const auto& child: children)
+        if (child->contains(v))
+            return true;
+    
+    return false;
+}
+
+BoundingBox Group::bounds() const {
+    BoundingBox l = localBounds();
+    Vec2 p = toWorld(Vec2(l.xmin, l.ymin)), q = toWorld(Vec2(l.xmax, l.ymax));
+    
+    return BoundingBox { std::min(p.x, q.x), std::min(p.y, q.y), std::max(p.x, q.x), std::max(p.y, q.y) };
+}
+
+void Group::sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const {
+    std::fill(hits, hits + n, 0);
+    
+    // Points and segments reach half a unit past their bounds
+    BoundingBox b = bounds();
+    Coord margin = Coord(0.5);
+    
+    if (children.empty() || y < b.ymin - margin || y > b.ymax + margin)
+        return;
+    
+    std::vector<unsigned char> childHits(n);
+    
+    if (factor == 1 && turns == 0) {
+        std::vector<Coord> shifted(n);
+        
+        for (int i {0}; i < n; i++)
+            shifted[i] = xs[i] - x;
+        
+        for (const auto& child: children) {
+            child->sampleRow(&shifted[0], n, y - this->y, &childHits[0]);
+            
+            for (int i {0}; i < n; i++)
+                hits[i] |= childHits[i];
+        }
+        return;
+    }
+    
+    // Scaling would scale the footprints of points and segments too, so
+    // sample the placed copies
+    if (factor != 1) {
+        for (size_t k {0}; k < children.size(); k++) {
+            scratch(k)->sampleRow(xs, n, y, &childHits[0]);
+            
+            for (int i {0}; i < n; i++)
+                hits[i] |= childHits[i];
+        }
+        return;
+    }
+    
+    // Turned rows run along the children's columns, so map each sample
+    for (int i {0}; i < n; i++) {
+        if (xs[i] < b.xmin - margin || xs[i] > b.xmax + margin)
+            continue;
+        
+        Vec2 v = toLocal(Vec2(xs[i], y));
+        
+        for (size_t k {0}; k < children.size() && !hits[i]; k++)
+            children[k]->sampleRow(&v.x, 1, v.y, &hits[i]);
+    }
+}
+
+void Group::rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const {
+    BoundingBox b = bounds();
+    
+    if (y < b.ymin || y > b.ymax)
+        return;
+    
+    if (factor == 1 && turns == 0) {
+        for (const auto& child: children)
+            child->rowSpans(y - this->y, x0 - x, count, spans);
+        return;
+    }
+    
+    // Otherwise test the cells under the group one by one
+    Coord lo = std::max(Coord(0), std::ceil(b.xmin - x0));
+    Coord hi = std::min(Coord(count - 1), std::floor(b.xmax - x0));
+    
+    if (!(lo <= hi))
+        return;
+    
+    int left = (int)lo, right = (int)hi;
+    
+    for (int k {left}; k <= right; k++) {
+        if (!contains(Vec2(x0 + k, y)))
+            continue;
+        
+        if (!spans.empty() && spans.back().last == k - 1)
+            spans.back().last = k;
+        else
+            spans.push_back(Span { k, k });
+    }
+}
+
+bool Group::intersects(const BoundingBox& box) const {
+    BoundingBox b = bounds();
+    
+    if (b.xmin > box.xmax || b.xmax < box.xmin || b.ymin > box.ymax || b.ymax < box.ymin)
+        return false;
+    
+    // Quarter turns keep boxes axis-aligned, so the box maps to a box
+    Vec2 p = toLocal(Vec2(box.xmin, box.ymin)), q = toLocal(Vec2(box.xmax, box.ymax));
+    BoundingBox mapped { std::min(p.x, q.x), std::min(p.y, q.y), std::max(p.x, q.x), std::max(p.y, q.y) };
+    
+    for (const auto& child: children)
+        if (child->intersects(mapped))
+            return true;
+    
+    return false;
+}
+
+bool Group::overlaps(const Shape& other) const {
+    BoundingBox o = other.bounds();
+    
+    // Answer as other.overlaps(*this) would, rather than testing placed
+    // copies that round differently
+    if (isBoxShape(other))
+        return intersects(o);
+    
+    if (laterComposite(*this, other))
+        return other.overlaps(*this);
+    
+    if (!intersects(o))
+        return false;
+    
+    Vec2 p = toLocal(Vec2(o.xmin, o.ymin)), q = toLocal(Vec2(o.xmax, o.ymax));
+    BoundingBox mapped { std::min(p.x, q.x), std::min(p.y, q.y), std::max(p.x, q.x), std::max(p.y, q.y) };
+    
+    for (size_t i {0}; i < children.size(); i++)
+        if (children[i]->intersects(mapped) && other.overlaps(*scratch(i)))
+            return true;
+    
+    return false;
+}
+
+Coord Group::distanceTo(Coord x, Coord y) const {
+    Coord best = std::numeric_limits<Coord>::max();
+    Vec2 v = toLocal(Vec2(x, y));
+    
+    // Quarter turns keep distances and scaling scales them
+    for (const auto& child: children)
+        best = std::min(best, child->distanceTo(v.x, v.y) * factor);
+    
+    return best;
+}
+
+std::shared_ptr<Shape> Group::clone() const {
+    return std::make_shared<Group>(*this);
+}
+
+void Group::changed(const Shape&) {
+    notify();
+}
+
+// ================= Scene class ===================
+
+// Last serial handed out, see Scene::id
+static std::atomic<unsigned long> sceneSerials { 0 };
+
+Scene::Scene() : index(new SpatialIndex) {
+    hasCustomDepth = false;
+    
+    drawDepth = -1;
+    
+    objectCount = 0;
+    serial = sceneSerials.fetch_add(1, std::memory_order_relaxed) + 1;
+    logStart = 0;
+    
+    indexValid = false;
+    indexedAt = 0;
+    refitted = 0;
+}
+
+Scene::~Scene() {
+    for (const auto& P: objectList)
+        for (const auto& listItem: P.second)
+            listItem->unwatch(this);
+}
+
+void Scene::addObject(std::shared_ptr<Shape> ptr) {
+    int depth = ptr->getDepth();
+    
+    GEOMETRY_COUNT(ObjectsAdded);    
+    ptr->watch(this);
+    objectCount++;
+    
+    {
+        std::lock_guard<std::mutex> guard(indexLock);
+        indexValid = false;
+        log(nullptr);
+    }
+    
+    if (objectList.find(depth) != objectList.end()) {
+        objectList[depth].push_back(ptr);
+    }
+    else {
+        objectList[depth] = std::vector<std::shared_ptr<Shape>>(1, ptr);
+    }
+}
+
+void Scene::setDrawDepth(int depth) {
+	if (depth < 0)
+        throw std::invalid_argument("Negative depth!");
+    
+    hasCustomDepth = true;
+    
+    drawDepth = depth;
+    
+    std::lock_guard<std::mutex> guard(indexLock);
+    log(nullptr);
+}
+
+void Scene::visibleShapes(std::vector<const Shape*>& shapes) const {
+    GEOMETRY_TRACE_SCOPE("cull");
+    
+    shapes.clear();
+
+    // Mirrors CheckEmpty: the first object deeper than drawDepth ends drawing
+    for (const auto& P: objectList) {
+        for (const auto& listItem: P.second) {
+            if (hasCustomDepth && drawDepth < listItem->getDepth())
+                return;
+
+            shapes.push_back(listItem.get());
+        }
+    }
+}
+
+// Set in masks[b] one bit for each sample of cell b on the canvas row at
+// height y that is covered by any of shapes, bit j*n + i being sub-column i
+// of sub-row j. masks must be all zero on entry. touched is set to the
+// range of cells each shape reached, which between them hold every set bit.
+static void sampleCanvasRow(const std::vector<const Shape*>& shapes, const std::vector<BoundingBox>& boxes,
+                            Coord left, Coord y, Coord cellSize, int width, int n, const std::vector<Coord>& xs,
+                            std::vector<unsigned char>& hits, std::vector<uint64_t>& masks,
+                            std::vector<Span>& touched) {
+    touched.clear();
+
+    // Boxes are padded by half a unit to cover point and line footprints,
+    // and cells reach half a cell either side of their centres
+    Coord reach = Coord(0.5) + cellSize / 2;
+    Coord bottom = y - reach, top = y + reach;
+    Coord west = left - reach, east = left + (width - 1) * cellSize + reach;
+
+    for (size_t k {0}; k < shapes.size(); k++) {
+        const BoundingBox& box = boxes[k];
+
+        if (box.ymax < bottom || box.ymin > top || box.xmax < west || box.xmin > east)
+            continue;
+
+        // Clamp before converting, as shapes may reach far past the canvas
+        Coord lo = std::max(Coord(0), std::ceil((box.xmin - left - reach) / cellSize));
+        Coord hi = std::min(Coord(width - 1), std::floor((box.xmax - left + reach) / cellSize));
+
+        if (!(lo <= hi))
+            continue;
+
+        int first = (int)lo, last = (int)hi;
+        int count = (last - first + 1) * n;
+
+        touched.push_back(Span { first, last });
+
+        for (int j {0}; j < n; j++) {
+            shapes[k]->sampleRow(&xs[first * n], count, y + ((j + Coord(0.5)) / n - Coord(0.5)) * cellSize, &hits[0]);
+
+            for (int b {first}; b <= last; b++) {
+                const unsigned char* cell = &hits[(b - first) * n];
+                uint64_t bits = 0;
+
+                for (int i {0}; i < n; i++)
+                    bits |= (uint64_t)cell[i] << i;
+
+                masks[b] |= bits << (j * n);
+            }
+        }
+    }
+}
+
+void rasteriseCoverage(const std::vector<const Shape*>& shapes, int samples, Coord left, Coord top,
+                       Coord cellSize, int width, int height, std::vector<float>& coverage) {
+    CoverageRasteriser raster(shapes, samples, left, top, cellSize, width, height);
+    std::vector<float> row;
+
+    coverage.resize(width * height);
+
+    {
+        GEOMETRY_TRACE_SCOPE("rasterise coverage");
+
+        while (raster.nextRow(row))
+            std::copy(row.begin(), row.end(), coverage.begin() + (size_t)raster.row() * width);
+    }
+}
+
+void Scene::renderCoverage(std::vector<float>& coverage, int samples, int width, int height) const {
+    GEOMETRY_TIME(Coverage);
+
+    std::vector<const Shape*> shapes;
+    visibleShapes(shapes);
+
+    rasteriseCoverage(shapes, samples, 0, height - 1, 1, width, height, coverage);
+}
+
+void Scene::renderCoverageByLayer(std::vector<float>& coverage, int samples, unsigned threads,
+                                  int width, int height) const {
+    if (samples < 1 || samples > 8)
+        throw std::invalid_argument("Samples per axis must be between 1 and 8");
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+
+    std::vector<const Shape*> shapes;
+    visibleShapes(shapes);
+
+    // Layers as coveredAreaByDepth takes them, largest first so that no
+    // worker is left with a big one at the end
+    std::map<int, std::vector<const Shape*>> layers;
+    for (const Shape* sh: shapes)
+        layers[sh->getDepth()].push_back(sh);
+
+    std::vector<const std::vector<const Shape*>*> order;
+    for (const auto& layer: layers)
+        order.push_back(&layer.second);
+    std::stable_sort(order.begin(), order.end(), [](const std::vector<const Shape*>* l, const std::vector<const Shape*>* r) {
+        return l->size() > r->size();
+    });
+
+    // Each layer keeps one rasteriser, which walks down the canvas a band
+    // of rows at a time
+    std::vector<CoverageRasteriser> rasterisers;
+    for (const std::vector<const Shape*>* layer: order)
+        rasterisers.emplace_back(*layer, samples, 0, height - 1, 1, width, height);
+
+    unsigned workerCount = std::max(1u, std::min(threads, (unsigned)order.size()));
+    int band = std::max(1, std::min(height, (int)(BAND_CELLS / std::max(1, width))));
+    std::vector<std::vector<uint64_t>> buffers(workerCount, std::vector<uint64_t>((size_t)width * band));
+
+    float perSample = 1.0f / (samples * samples);
+    coverage.resize((size_t)width * height);
+
+    for (int first {0}; first < height; first += band) {
+        int rows = std::min(band, height - first);
+
+        std::atomic<size_t> next { 0 };
+        auto worker = [&](unsigned w) {
+            std::vector<uint64_t>& buffer = buffers[w];
+            std::fill(buffer.begin(), buffer.end(), 0);
+
+            for (size_t i = next.fetch_add(1); i < order.size(); i = next.fetch_add(1)) {
+                GEOMETRY_TRACE_SCOPE_ARG("coverage layer", "shapes", (int)order[i]->size());
+
+                for (int a {0}; a < rows; a++)
+                    rasterisers[i].mergeRow(&buffer[(size_t)a * width]);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned t {1}; t < workerCount; t++)
+            workers.emplace_back(worker, t);
+
+        worker(0);
+
+        for (std::thread& t: workers)
+            t.join();
+
+        GEOMETRY_TRACE_SCOPE("composite layers");
+
+        for (size_t c {0}; c < (size_t)width * rows; c++) {
+            uint64_t bits = 0;
+
+            for (const std::vector<uint64_t>& buffer: buffers)
+                bits |= buffer[c];
+
+            coverage[(size_t)first * width + c] = __builtin_popcountll(bits) * perSample;
+        }
+    }
+}
+
+void Scene::renderGrayscale(std::vector<unsigned char>& pixels, int samples, int width, int height) const {
+    std::vector<float> coverage;
+    renderCoverage(coverage, samples, width, height);
+
+    pixels.resize(coverage.size());
+    for (size_t i {0}; i < coverage.size(); i++)
+        pixels[i] = (unsigned char)std::lround(coverage[i] * 255);
+}
+
+void Scene::drawCoverage(std::ostream& out, int samples, const std::string& ramp) const {
+    if (ramp.empty())
+        throw std::invalid_argument("Empty character ramp");
+
+    std::vector<float> coverage;
+    renderCoverage(coverage, samples);
+
+    int top = ramp.size() - 1;
+
+    for (int a {0}; a < HEIGHT; a++) {
+        for (int b {0}; b < WIDTH; b++)
+            out << ramp[std::lround(coverage[a * WIDTH + b] * top)];
+        out << std::endl;
+    }
+}
+
+void Scene::changed(const Shape& sh) {
+    std::lock_guard<std::mutex> guard(indexLock);
+    log(&sh);
+}
+
+void Scene::log(const Shape* sh) {
+    // Drop the older half once the log outgrows the scene
+    size_t limit = 2 * std::max(objectCount, (size_t)512);
+    if (changeLog.size() >= limit) {
+        changeLog.erase(changeLog.begin(), changeLog.begin() + limit / 2);
+        logStart += limit / 2;
+    }
+    
+    changeLog.push_back(sh);
+}
+
+unsigned long Scene::version() const {
+    std::lock_guard<std::mutex> guard(indexLock);
+    return logStart + changeLog.size();
+}
+
+bool Scene::changesSince(unsigned long since, std::vector<const Shape*>& changed) const {
+    std::lock_guard<std::mutex> guard(indexLock);
+    
+    if (since < logStart || since > logStart + changeLog.size())
+        return false;
+    
+    changed.insert(changed.end(), changeLog.begin() + (since - logStart), changeLog.end());
+    return true;
+}
+
+unsigned long Scene::id() const {
+    return serial;
+}
+
+const SpatialIndex& Scene::spatialIndex() const {
+    std::lock_guard<std::mutex> guard(indexLock);
+    
+    unsigned long now = logStart + changeLog.size();
+    
+    if (indexValid && indexedAt != now && indexedAt >= logStart && refitted <= index->size()) {
+        GEOMETRY_COUNT_N(IndexRefits, now - indexedAt);
+        
+        std::vector<const Shape*> moved(changeLog.begin() + (indexedAt - logStart), changeLog.end());
+        index->refit(moved);
+        refitted += moved.size();
+        indexedAt = now;
+    }
+    
+    if (!indexValid || indexedAt != now) {
+        GEOMETRY_COUNT(IndexRebuilds);
+        
+        std::vector<Shape*> all;
+        for (const auto& P: objectList)
+            for (const auto& listItem: P.second)
+                all.push_back(listItem.get());
+        
+        index->build(all);
+        indexValid = true;
+        indexedAt = now;
+        refitted = 0;
+    }
+    
+    return *index;
+}
+
+void Scene::queryRange(Coord xmin, Coord ymin, Coord xmax, Coord ymax, int depthFilter,
+                       std::vector<Shape*>& results) const {
+    GEOMETRY_COUNT(RangeQueries);
+    GEOMETRY_TIME(RangeQuery);
+    
+    BoundingBox box { xmin, ymin, xmax, ymax };
+    
+    results.clear();
+    
+    spatialIndex().query(box, [&](Shape* sh) {
+        if ((depthFilter < 0 || sh->getDepth() <= depthFilter) && sh->intersects(box))
+            results.push_back(sh);
+    });
+}
+
+// Sweep and prune: with boxes sorted on xmin, box i can only meet the boxes
+// after it whose xmin is within its x-range. Blocks of i are handed out to
+// the workers from a shared counter so clustered scenes stay balanced.
+template<typename Report>
+static void sweepAndPrune(const std::vector<std::pair<BoundingBox, Shape*>>& boxes, unsigned threads,
+                          const Report& report) {
+    const size_t BLOCK = 256;
+    std::atomic<size_t> nextBlock { 0 };
+    
+    auto worker = [&](unsigned id) {
+        for (size_t first = nextBlock.fetch_add(BLOCK); first < boxes.size(); first = nextBlock.fetch_add(BLOCK)) {
+            size_t last = std::min(first + BLOCK, boxes.size());
+            
+            for (size_t i {first}; i < last; i++) {
+                const BoundingBox& a = boxes[i].first;
+                
+                for (size_t j {i + 1}; j < boxes.size() && boxes[j].first.xmin <= a.xmax; j++) {
+                    const BoundingBox& b = boxes[j].first;
+                    
+                    if (b.ymin <= a.ymax && a.ymin <= b.ymax && boxes[i].second->overlaps(*boxes[j].second))
+                        report(id, boxes[i].second, boxes[j].second);
+                }
+            }
+        }
+    };
+    
+    threads = std::max(1u, threads);
+    
+    std::vector<std::thread> workers;
+    for (unsigned t {1}; t < threads; t++)
+        workers.emplace_back(worker, t);
+    
+    worker(0);
+    
+    for (std::thread& t: workers)
+        t.join();
+}
+
+static void sortedBoxes(const std::map< int, std::vector<std::shared_ptr<Shape>> >& objectList,
+                        std::vector<std::pair<BoundingBox, Shape*>>& boxes) {
+    for (const auto& P: objectList)
+        for (const auto& listItem: P.second)
+            boxes.push_back(std::make_pair(listItem->bounds(), listItem.get()));
+    
+    std::sort(boxes.begin(), boxes.end(),
+              [](const std::pair<BoundingBox, Shape*>& l, const std::pair<BoundingBox, Shape*>& r) {
+                  return l.first.xmin < r.first.xmin;
+              });
+}
+
+void Scene::findOverlaps(std::vector<std::pair<Shape*, Shape*>>& pairs, unsigned threads) const {
+    GEOMETRY_COUNT(OverlapQueries);
+    GEOMETRY_TIME(OverlapQuery);
+    
+    std::vector<std::pair<BoundingBox, Shape*>> boxes;
+    sortedBoxes(objectList, boxes);
+    
+    pairs.clear();
+    threads = std::max(1u, threads);
+    
+    if (threads == 1) {
+        sweepAndPrune(boxes, 1, [&](unsigned, Shape* a, Shape* b) { pairs.push_back(std::make_pair(a, b)); });
+        return;
+    }
+    
+    // Workers collect separately and the results are joined at the end
+    std::vector<std::vector<std::pair<Shape*, Shape*>>> found(threads);
+    sweepAndPrune(boxes, threads, [&](unsigned id, Shape* a, Shape* b) { found[id].push_back(std::make_pair(a, b)); });
+    
+    for (const auto& part: found)
+        pairs.insert(pairs.end(), part.begin(), part.end());
+}
+
+void Scene::findOverlaps(const std::function<void(Shape*, Shape*)>& report, unsigned threads) const {
+    GEOMETRY_COUNT(OverlapQueries);
+    GEOMETRY_TIME(OverlapQuery);
+    
+    std::vector<std::pair<BoundingBox, Shape*>> boxes;
+    sortedBoxes(objectList, boxes);
+    
+    sweepAndPrune(boxes, threads, [&](unsigned, Shape* a, Shape* b) { report(a, b); });
+}
+
+// Union length of the intervals [lo, hi], which are sorted in place
+static double unionLength(std::vector<std::pair<double, double>>& intervals) {
+    std::sort(intervals.begin(), intervals.end());
+    
+    double total {0}, lo {0}, hi {0};
+    bool open {false};
+    
+    for (const auto& in: intervals) {
+        if (open && in.first <= hi)
+            hi = std::max(hi, in.second);
+        else {
+            if (open)
+                total += hi - lo;
+            lo = in.first;
+            hi = in.second;
+            open = true;
+        }
+    }
+    
+    return open ? total + (hi - lo) : total;
+}
+
+// Segment tree over the gaps between sorted y-coordinates, tracking how
+// often each gap is covered and the total length covered
+class CoverTree {
+public:
+    CoverTree(const std::vector<double>& ys) : ys(ys), count(4 * ys.size()), covered(4 * ys.size()) {}
+
+    // Add (+1) or remove (-1) cover of [ys[lo], ys[hi]]
+    void update(size_t lo, size_t hi, int delta) {
+        if (lo < hi)
+            update(1, 0, ys.size() - 1, lo, hi, delta);
+    }
+
+    double length() const {
+        return covered.empty() ? 0 : covered[1];
+    }
+
+    // Covered length within [a, b]
+    double coveredIn(double a, double b) const {
+        return ys.size() < 2 ? 0 : coveredIn(1, 0, ys.size() - 1, a, b);
+    }
+
+private:
+    const std::vector<double>& ys;
+    std::vector<int> count;
+    std::vector<double> covered;
+
+    void update(size_t node, size_t l, size_t r, size_t lo, size_t hi, int delta) {
+        if (hi <= l || r <= lo)
+            return;
+        
+        if (lo <= l && r <= hi)
+            count[node] += delta;
+        else {
+            size_t m = (l + r) / 2;
+            update(2 * node, l, m, lo, hi, delta);
+            update(2 * node + 1, m, r, lo, hi, delta);
+        }
+        
+        if (count[node] > 0)
+            covered[node] = ys[r] - ys[l];
+        else if (r - l == 1)
+            covered[node] = 0;
+        else
+            covered[node] = covered[2 * node] + covered[2 * node + 1];
+    }
+
+    double coveredIn(size_t node, size_t l, size_t r, double a, double b) const {
+        double lo = std::max(a, ys[l]), hi = std::min(b, ys[r]);
+        
+        if (lo >= hi)
+            return 0;
+        if (count[node] > 0)
+            return hi - lo;
+        if (r - l == 1)
+            return 0;
+        if (a <= ys[l] && ys[r] <= b)
+            return covered[node];
+        
+        size_t m = (l + r) / 2;
+        return coveredIn(2 * node, l, m, a, b) + coveredIn(2 * node + 1, m, r, a, b);
+    }
+};
+
+// Union area of the two-dimensional shapes among shapes. The plane is cut
+// into slabs at every shape's left and right edge. Rectangles sit in a
+// CoverTree, so a slab crossed by rectangles only has a constant cross
+// section and is exact. Slabs crossed by circles are integrated with
+// adaptive Simpson's rule, the cross section being the tree's length plus
+// whatever the circles' chords add outside the rectangles. Polygons are
+// handled like circles, with their vertices cutting extra slabs so each
+// slab only sees straight pieces of their outlines. Each cross section
+// visits every circle and polygon active at x, so with k of them active
+// across s slabs the integration costs O(s k log k) on top of the sweep,
+// O(n^2 log n) at worst.
+static double unionArea(const std::vector<const Shape*>& shapes, double tolerance) {
+    GEOMETRY_TIME(CoveredArea);
+    
+    // Measure instanced shapes and groups part by part, replacing each by
+    // its placed parts (which may be sets or groups themselves) as they are
+    // reached
+    std::vector<std::shared_ptr<Shape>> placed;
+    std::vector<const Shape*> expanded(shapes);
+    
+    for (size_t k {0}; k < expanded.size(); k++) {
+        const InstanceSet* set = dynamic_cast<const InstanceSet*>(expanded[k]);
+        const Group* group = dynamic_cast<const Group*>(expanded[k]);
+        size_t start = placed.size();
+        
+        if (set != nullptr)
+            for (size_t i {0}; i < set->getSize(); i++)
+                placed.push_back(set->place(i));
+        else if (group != nullptr)
+            for (size_t i {0}; i < group->getSize(); i++)
+                placed.push_back(group->place(i));
+        else
+            continue;
+        
+        for (size_t i {start}; i < placed.size(); i++)
+            expanded.push_back(placed[i].get());
+        expanded[k] = nullptr;
+    }
+    
+    // change is +1 where a shape starts, -1 where it ends and 0 at a
+    // polygon vertex in between
+    struct Edge {
+        double x;
+        size_t shape;
+        int change;
+    };
+    
+    std::vector<const Shape*> areas;
+    std::vector<BoundingBox> boxes;
+    std::vector<bool> curved;
+    std::vector<const Polygon*> outlines;
+    std::vector<double> ys;
+    
+    for (const Shape* sh: expanded) {
+        if (sh == nullptr || sh->dim() < 2)
+            continue;
+        
+        BoundingBox b = sh->bounds();
+        const Polygon* poly = dynamic_cast<const Polygon*>(sh);
+        bool isCurved = poly != nullptr || dynamic_cast<const Circle*>(sh) != nullptr;
+        
+        areas.push_back(sh);
+        boxes.push_back(b);
+        curved.push_back(isCurved);
+        outlines.push_back(poly);
+        
+        if (!isCurved) {
+            ys.push_back(b.ymin);
+            ys.push_back(b.ymax);
+        }
+    }
+    
+    if (areas.empty())
+        return 0;
+    
+    // Cross sections are sums and differences of y-coordinates, so they
+    // carry rounding errors in proportion to the largest of them. Slabs whose
+    // sections are down to that noise are taken as converged, or refining
+    // them would never meet a tolerance relative to a near zero area.
+    double reach {0};
+    for (const BoundingBox& b: boxes)
+        reach = std::max(reach, (double)std::max(std::fabs(b.ymin), std::fabs(b.ymax)));
+    double noise = 64 * std::numeric_limits<double>::epsilon() * reach;
+    
+    std::sort(ys.begin(), ys.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+    
+    auto yIndex = [&](double y) { return std::lower_bound(ys.begin(), ys.end(), y) - ys.begin(); };
+    
+    std::vector<Edge> edges;
+    for (size_t i {0}; i < areas.size(); i++) {
+        edges.push_back(Edge { boxes[i].xmin, i, 1 });
+        edges.push_back(Edge { boxes[i].xmax, i, -1 });
+        
+        if (outlines[i] != nullptr)
+            for (size_t v {0}; v < outlines[i]->getSize(); v++)
+                edges.push_back(Edge { outlines[i]->getX(v), i, 0 });
+    }
+    std::sort(edges.begin(), edges.end(), [](const Edge& l, const Edge& r) { return l.x < r.x; });
+    
+    CoverTree tree(ys);
+    
+    // Curved shapes whose slabs the sweep is in, and where each one sits in
+    // active so it can be swapped out in O(1)
+    std::vector<size_t> active, slot(areas.size());
+    double total {0};
+    
+    std::vector<std::pair<double, double>> intervals;
+    
+    // Cross-section length at x of everything active
+    auto section = [&](double x) {
+        intervals.clear();
+        for (size_t i: active) {
+            if (outlines[i] != nullptr) {
+                outlines[i]->columnRanges(x, intervals);
+                continue;
+            }
+            
+            const BoundingBox& b = boxes[i];
+            double r  = (b.xmax - b.xmin) / 2.0;
+            double dx = x - (b.xmin + r);
+            double h  = sqrt(std::max(0.0, r * r - dx * dx));
+            double cy = (b.ymin + b.ymax) / 2.0;
+            
+            intervals.push_back(std::make_pair(cy - h, cy + h));
+        }
+        
+        double length = tree.length() + unionLength(intervals);
+        
+        // unionLength left the chords sorted; merge them again to take off
+        // the parts already counted by the rectangles
+        double lo {0}, hi {0};
+        bool open {false};
+        for (const auto& in: intervals) {
+            if (open && in.first <= hi)
+                hi = std::max(hi, in.second);
+            else {
+                if (open)
+                    length -= tree.coveredIn(lo, hi);
+                lo = in.first;
+                hi = in.second;
+                open = true;
+            }
+        }
+        if (open)
+            length -= tree.coveredIn(lo, hi);
+        
+        return length;
+    };
+    
+    std::function<double(double, double, double, double, double, double, double, int)> simpson;
+    simpson = [&](double a, double b, double fa, double fm, double fb, double whole, double tol, int depth) {
+        double m = (a + b) / 2, lm = (a + m) / 2, rm = (m + b) / 2;
+        double flm = section(lm), frm = section(rm);
+        double left  = (m - a) / 6 * (fa + 4 * flm + fm);
+        double right = (b - m) / 6 * (fm + 4 * frm + fb);
+        
+        if (depth <= 0 || std::fabs(left + right - whole) <= 15 * std::max(tol, (b - a) * noise))
+            return left + right + (left + right - whole) / 15;
+        
+        return simpson(a, m, fa, flm, fm, left, tol / 2, depth - 1) +
+               simpson(m, b, fm, frm, fb, right, tol / 2, depth - 1);
+    };
+    
+    for (size_t e {0}; e < edges.size(); ) {
+        double x = edges[e].x;
+        
+        // Apply every edge at x before measuring the slab to its right
+        for (; e < edges.size() && edges[e].x == x; e++) {
+            size_t i = edges[e].shape;
+            int delta = edges[e].change;
+            
+            if (delta == 0)
+                continue;
+            else if (!curved[i])
+                tree.update(yIndex(boxes[i].ymin), yIndex(boxes[i].ymax), delta);
+            else if (delta > 0) {
+                slot[i] = active.size();
+                active.push_back(i);
+            } else {
+                slot[active.back()] = slot[i];
+                active[slot[i]] = active.back();
+                active.pop_back();
+            }
+        }
+        
+        if (e == edges.size())
+            break;
+        
+        double next = edges[e].x, slab = next - x;
+        
+        if (active.empty())
+            total += tree.length() * slab;
+        else {
+            double fa = section(x), fm = section((x + next) / 2), fb = section(next);
+            double whole = slab / 6 * (fa + 4 * fm + fb);
+            
+            // Each slab gets the same relative error so the total does too
+            total += simpson(x, next, fa, fm, fb, whole, tolerance * whole, 30);
+        }
+    }
+    
+    return total;
+}
+
+double Scene::coveredArea(double tolerance) const {
+    std::vector<const Shape*> shapes;
+    visibleShapes(shapes);
+    
+    return unionArea(shapes, tolerance);
+}
+
+double Scene::coveredAreaAtDepth(int d, double tolerance) const {
+    std::vector<const Shape*> shapes, layer;
+    visibleShapes(shapes);
+    
+    for (const Shape* sh: shapes)
+        if (sh->getDepth() == d)
+            layer.push_back(sh);
+    
+    return unionArea(layer, tolerance);
+}
+
+std::map<int, double> Scene::coveredAreaByDepth(unsigned threads, double tolerance) const {
+    std::vector<const Shape*> shapes;
+    visibleShapes(shapes);
+    
+    std::map<int, std::vector<const Shape*>> layers;
+    for (const Shape* sh: shapes)
+        layers[sh->getDepth()].push_back(sh);
+    
+    std::vector<int> depths;
+    std::vector<double> areas(layers.size());
+    for (const auto& layer: layers)
+        depths.push_back(layer.first);
+    
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]() {
+        for (size_t i = next.fetch_add(1); i < depths.size(); i = next.fetch_add(1)) {
+            GEOMETRY_TRACE_SCOPE_ARG("area layer", "depth", depths[i]);
+            areas[i] = unionArea(layers.at(depths[i]), tolerance);
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    for (unsigned t {1}; t < threads; t++)
+        workers.emplace_back(worker);
+    
+    worker();
+    
+    for (std::thread& t: workers)
+        t.join();
+    
+    std::map<int, double> result;
+    for (size_t i {0}; i < depths.size(); i++)
+        result[depths[i]] = areas[i];
+    
+    return result;
+}
+
+RenderJob Scene::renderAsync(int bandRows, unsigned threads, int width, int height) const {
+    if (bandRows <= 0)
+        throw std::invalid_argument("Band height must be positive");
+    
+    // State shared with the workers, who outlive this call
+    struct Job {
+        Job(const Scene& s, int width, int height) : raster(s, width, height), nextBand(0) {}
+        
+        RowRasteriser raster;
+        std::vector<std::promise<std::string>> bands;
+        std::atomic<size_t> nextBand;
+        int bandRows;
+    };
+    
+    auto job = std::make_shared<Job>(*this, width, height);
+    job->bandRows = bandRows;
+    job->bands.resize(height / bandRows + (height % bandRows != 0));
+    
+    RenderJob render;
+    for (auto& band: job->bands)
+        render.bands.push_back(band.get_future());
+    
+    // Bands are claimed in order, so the first ones are ready first
+    auto worker = [job]() {
+        RowRasteriser raster = job->raster;
+        std::vector<Span> spans;
+        
+        for (size_t b = job->nextBand.fetch_add(1); b < job->bands.size(); b = job->nextBand.fetch_add(1)) {
+            GEOMETRY_TRACE_SCOPE_ARG("rasterise band", "band", b);
+            
+            int first = b * job->bandRows;
+            int last  = first + std::min(job->bandRows, raster.getHeight() - first);
+            int width = raster.getWidth();
+            std::string text((size_t)(last - first) * (width + 1), ' ');
+            
+            raster.seek(first);
+            for (int a {first}; a < last && raster.nextRow(spans); a++) {
+                char* line = &text[(size_t)(a - first) * (width + 1)];
+                for (const Span& span: spans)
+                    std::fill(line + span.first, line + span.last + 1, '*');
+                line[width] = '\n';
+            }
+            
+            job->bands[b].set_value(std::move(text));
+        }
+    };
+    
+    threads = std::max(1u, (unsigned)std::min<size_t>(threads, job->bands.size()));
+    for (unsigned t {0}; t < threads; t++)
+        render.workers.push_back(std::thread(worker));
+    
+    return render;
+}
+
+SceneStats Scene::stats() {
+    return Stats::collect();
+}
+
+void Scene::resetStats() {
+    Stats::reset();
+}
+
+std::shared_ptr<Scene> Scene::snapshot() const {
+    std::shared_ptr<Scene> copy = std::make_shared<Scene>();
+    
+    copy->hasCustomDepth = hasCustomDepth;
+    copy->drawDepth = drawDepth;
+    copy->objectCount = objectCount;
+    
+    // Keep the depth grouping and order of the original, which drawing relies
+    // on. Nothing else holds the clones, so the copy does not watch them.
+    for (const auto& P: objectList) {
+        std::vector<std::shared_ptr<Shape>>& layer = copy->objectList[P.first];
+        for (const auto& listItem: P.second)
+            layer.push_back(listItem->clone());
+    }
+    
+    return copy;
+}
+
+void Scene::nearest(Coord x, Coord y, size_t k, std::vector<Neighbour>& results) const {
+    GEOMETRY_COUNT(NearestQueries);
+    GEOMETRY_TIME(NearestQuery);
+    
+    spatialIndex().nearest(x, y, k, results);
+}
+
+std::vector<Neighbour> Scene::nearest(Coord x, Coord y, size_t k) const {
+    std::vector<Neighbour> results;
+    nearest(x, y, k, results);
+    return results;
+}
+
+bool CheckEmpty(const Scene& s, Vec2 p) {
+    GEOMETRY_COUNT(CellsTested);
+   
+    for (const auto& P: s.objectList) {
+        for (const auto& listItem: P.second) {
+        
+            if (s.hasCustomDepth && s.drawDepth < listItem->getDepth()) {
+                GEOMETRY_COUNT(DepthCutoffs);
+                return false;
+            }
+        
+            if (listItem->contains(p))
+                return true;
+        }
+    }
+    
+    return false;
+}
+
+std::ostream& operator<<(std::ostream& out, const Scene& s) {
+    GEOMETRY_TIME(Render);
+    GEOMETRY_TRACE_SCOPE("render");
+    
+    for (int a {0}; a < s.HEIGHT; a++) {
+        for (int b {0}; b < s.WIDTH; b++) {
+            
+            Vec2 currentPosition (b, s.HEIGHT - a - 1);
+            
+            if (CheckEmpty(s, currentPosition))
+                out << '*';
+            else
+                out << ' ';
+        }
+        out << std::endl;
+    }
+    
+	return out;
+}
+
+
+
+// ============== CoverageRasteriser class ================
+
+CoverageRasteriser::CoverageRasteriser(const std::vector<const Shape*>& shapes, int samples, Coord left,
+                                       Coord top, Coord cellSize, int width, int height)
+    : samples(samples), width(width), height(height), current(-1), left(left), top(top),
+      cellSize(cellSize), nextShape(0) {
+    if (samples < 1 || samples > 8)
+        throw std::invalid_argument("Samples per axis must be between 1 and 8");
+    if (!(cellSize > 0))
+        throw std::invalid_argument("Cell size must be positive");
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+
+    // Shapes wholly left or right of the canvas never reach a cell, as in
+    // sampleCanvasRow
+    Coord reach = Coord(0.5) + cellSize / 2;
+    Coord west = left - reach, east = left + (width - 1) * cellSize + reach;
+
+    std::vector<std::pair<BoundingBox, const Shape*>> order;
+    for (const Shape* sh: shapes) {
+        BoundingBox b = sh->bounds();
+
+        if (!(b.xmax < west || b.xmin > east))
+            order.push_back(std::make_pair(b, sh));
+    }
+
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<BoundingBox, const Shape*>& l, const std::pair<BoundingBox, const Shape*>& r) {
+                         return l.first.ymax > r.first.ymax;
+                     });
+
+    for (const auto& entry: order) {
+        boxes.push_back(entry.first);
+        this->shapes.push_back(entry.second);
+    }
+
+    // Sample x-coordinates of every sub-column, laid out cell after cell
+    xs.resize(width * samples);
+    for (int b {0}; b < width; b++)
+        for (int i {0}; i < samples; i++)
+            xs[b * samples + i] = left + (b + (i + Coord(0.5)) / samples - Coord(0.5)) * cellSize;
+
+    hits.resize(width * samples);
+    masks.assign(width, 0);
+}
+
+bool CoverageRasteriser::advance() {
+    if (current + 1 >= height)
+        return false;
+
+    current++;
+
+    // The tests of sampleCanvasRow, which keeps rejecting a shape once rows
+    // have passed below it
+    Coord y = top - current * cellSize;
+    Coord reach = Coord(0.5) + cellSize / 2;
+    Coord bottom = y - reach, above = y + reach;
+
+    while (nextShape < shapes.size() && !(boxes[nextShape].ymax < bottom)) {
+        activeShapes.push_back(shapes[nextShape]);
+        activeBoxes.push_back(boxes[nextShape]);
+        nextShape++;
+    }
+
+    size_t kept {0};
+    for (size_t k {0}; k < activeShapes.size(); k++) {
+        if (activeBoxes[k].ymin > above)
+            continue;
+
+        activeShapes[kept] = activeShapes[k];
+        activeBoxes[kept++] = activeBoxes[k];
+    }
+    activeShapes.resize(kept);
+    activeBoxes.resize(kept);
+
+    // Clear only what the last row set
+    for (const Span& span: touched)
+        std::fill(masks.begin() + span.first, masks.begin() + span.last + 1, 0);
+
+    sampleCanvasRow(activeShapes, activeBoxes, left, y, cellSize, width, samples, xs, hits, masks, touched);
+    return true;
+}
+
+bool CoverageRasteriser::nextRow(std::vector<float>& row) {
+    if (!advance())
+        return false;
+
+    float perSample = 1.0f / (samples * samples);
+
+    row.resize(width);
+    for (int b {0}; b < width; b++)
+        row[b] = __builtin_popcountll(masks[b]) * perSample;
+
+    return true;
+}
+
+bool CoverageRasteriser::mergeRow(uint64_t* cells) {
+    if (!advance())
+        return false;
+
+    for (const Span& span: touched)
+        for (int b {span.first}; b <= span.last; b++)
+            cells[b] |= masks[b];
+
+    return true;
+}
+
+int CoverageRasteriser::row() const {
+    return current;
+}
+
+int CoverageRasteriser::getWidth() const {
+    return width;
+}
+
+int CoverageRasteriser::getHeight() const {
+    return height;
+}
+
+
+// ============== SceneSnapshots class ================
+
+SceneSnapshots::SceneSnapshots() : current(std::make_shared<Scene>()), published(0) {}
+
+void SceneSnapshots::publish(const Scene& s) {
+    std::shared_ptr<const Scene> next = s.snapshot();
+    
+    std::atomic_store(&current, next);
+    published.fetch_add(1);
+}
+
+std::shared_ptr<const Scene> SceneSnapshots::acquire() const {
+    return std::atomic_load(&current);
+}
+
+unsigned long SceneSnapshots::version() const {
+    return published.load();
+}
+
+
+
+// ============== ChangeTracker class ================
+
+void ChangeTracker::update(const Scene& s, std::vector<BoundingBox>& dirty) {
+    dirty.clear();
+    
+    // Only the logged shapes can have changed, unless the drawing itself
+    // might have: objects added, the drawing depth or a depth changed
+    unsigned long version = s.version();
+    logged.clear();
+    
+    if (s.id() == scene && s.changesSince(seen, logged)) {
+        bool redraw = false;
+        
+        for (const Shape* sh: logged) {
+            auto found = sh ? slots.find(sh) : slots.end();
+            
+            if (found == slots.end() || depths[found->second] != sh->getDepth()) {
+                redraw = true;
+                break;
+            }
+        }
+        
+        if (!redraw) {
+            for (const Shape* sh: logged) {
+                size_t k = slots[sh];
+                unsigned long now = sh->version();
+                
+                if (now != versions[k]) {
+                    dirty.push_back(bounds[k]);
+                    bounds[k] = sh->bounds();
+                    dirty.push_back(bounds[k]);
+                    versions[k] = now;
+                }
+            }
+            
+            seen = version;
+            return;
+        }
+    }
+    
+    scene = s.id();
+    seen = version;
+    s.visibleShapes(next);
+
+    std::vector<bool> kept(drawn.size(), false);
+    std::vector<unsigned long> nextVersions(next.size());
+    std::vector<BoundingBox> nextBounds(next.size());
+    std::vector<int> nextDepths(next.size());
+
+    for (size_t k {0}; k < next.size(); k++) {
+        auto found = slots.find(next[k]);
+        nextVersions[k] = next[k]->version();
+        nextDepths[k] = next[k]->getDepth();
+
+        if (found != slots.end()) {
+            kept[found->second] = true;
+
+            if (versions[found->second] == nextVersions[k]) {
+                nextBounds[k] = bounds[found->second];
+                continue;
+            }
+            dirty.push_back(bounds[found->second]);
+        }
+
+        nextBounds[k] = next[k]->bounds();
+        dirty.push_back(nextBounds[k]);
+    }
+
+    // Whatever was not drawn this time has gone
+    for (size_t k {0}; k < drawn.size(); k++)
+        if (!kept[k])
+            dirty.push_back(bounds[k]);
+
+    drawn.swap(next);
+    versions.swap(nextVersions);
+    bounds.swap(nextBounds);
+    depths.swap(nextDepths);
+    
+    slots.clear();
+    for (size_t k {0}; k < drawn.size(); k++)
+        slots.emplace(drawn[k], k);
+}
+
+const std::vector<const Shape*>& ChangeTracker::shapes() const {
+    return drawn;
+}
+
+const std::vector<BoundingBox>& ChangeTracker::boxes() const {
+    return bounds;
+}
+
+bool ChangeTracker::isDrawn(const Shape* sh) const {
+    return slots.count(sh) > 0;
+}
+
+
+
+// ============== RowRasteriser class ================
+
+RowRasteriser::RowRasteriser(const Scene& s, int width, int height, MaskCache* cache) {
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+
+    this->width  = width;
+    this->height = height;
+    current   = -1;
+    nextShape = 0;
+
+    GEOMETRY_TRACE_SCOPE("sort shapes");
+    
+    std::vector<const Shape*> visible;
+    s.visibleShapes(visible);
+
+    // Row a holds world y = height - a - 1, so the top of a shape maps to its first row
+    std::vector<std::pair<int, const Shape*>> order;
+    std::vector<int> lastOf;
+    
+    for (const Shape* sh: visible) {
+        BoundingBox b = sh->bounds();
+        
+        if (b.ymax < 0 || b.ymin > height - 1 || b.xmax < 0 || b.xmin > width - 1)
+            continue;
+        
+        int first = std::max(0, height - 1 - (int)std::floor(std::min(b.ymax, (Coord)height)));
+        order.push_back(std::make_pair(first, sh));
+    }
+    
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<int, const Shape*>& l, const std::pair<int, const Shape*>& r) {
+                         return l.first < r.first;
+                     });
+    
+    for (const auto& entry: order) {
+        BoundingBox b = entry.second->bounds();
+        
+        shapes.push_back(entry.second);
+        firstRows.push_back(entry.first);
+        lastRows.push_back(std::min(height - 1, height - 1 - (int)std::ceil(std::max(b.ymin, -Coord(1.0)))));
+
+        if (cache) {
+            int ox {0}, oy {0};
+
+            masks.push_back(cache->find(*entry.second, 0, height - 1, ox, oy));
+            originX.push_back(ox);
+            originY.push_back(oy);
+        }
+    }
+}
+
+bool RowRasteriser::nextRow(std::vector<Span>& spans) {
+    spans.clear();
+    
+    if (current + 1 >= height)
+        return false;
+    
+    current++;
+    
+    // Retire shapes that ended above this row, then admit those starting on it
+    for (size_t i {0}; i < active.size(); ) {
+        if (lastRows[active[i]] < current) {
+            active[i] = active.back();
+            active.pop_back();
+        }
+        else
+            i++;
+    }
+    
+    while (nextShape < shapes.size() && firstRows[nextShape] <= current) {
+        if (lastRows[nextShape] >= current)
+            active.push_back(nextShape);
+        nextShape++;
+    }
+    
+    Coord y = height - current - 1;
+    
+    GEOMETRY_COUNT(RowsRasterised);
+    
+    for (size_t i: active) {
+        if (!masks.empty() && masks[i])
+            masks[i]->rowSpans(originX[i], originY[i], height - current - 1, 0, width, spans);
+        else
+            shapes[i]->rowSpans(y, 0, width, spans);
+    }
+    
+    if (spans.size() < 2) {
+        GEOMETRY_COUNT_N(SpansProduced, spans.size());
+        return true;
+    }
+    
+    // Merge overlapping and touching spans
+    std::sort(spans.begin(), spans.end(), [](const Span& l, const Span& r) { return l.first < r.first; });
+    
+    size_t out {0};
+    for (size_t i {1}; i < spans.size(); i++) {
+        if (spans[i].first <= spans[out].last + 1)
+            spans[out].last = std::max(spans[out].last, spans[i].last);
+        else
+            spans[++out] = spans[i];
+    }
+    spans.resize(out + 1);
+    
+    GEOMETRY_COUNT_N(SpansProduced, spans.size());
+    return true;
+}
+
+int RowRasteriser::row() const {
+    return current;
+}
+
+void RowRasteriser::seek(int row) {
+    // nextRow admits every shape that has started and not yet ended
+    current = std::min(std::max(row, 0), height) - 1;
+    nextShape = 0;
+    active.clear();
+}
+
+int RowRasteriser::getWidth() const {
+    return width;
+}
+
+int RowRasteriser::getHeight() const {
+    return height;
+}
+
+
+
+// ============== RenderedRows class ================
+
+RenderedRows::RenderedRows(const Scene& s, int width, int height) : raster(s, width, height) {}
+
+bool RenderedRows::advance() {
+    if (!raster.nextRow(spans))
+        return false;
+    
+    line.assign(raster.getWidth(), ' ');
+    for (const Span& span: spans)
+        std::fill(line.begin() + span.first, line.begin() + span.last + 1, '*');
+    
+    return true;
+}
+
+RenderedRows::iterator RenderedRows::begin() {
+    return iterator(advance() ? this : nullptr);
+}
+
+RenderedRows::iterator RenderedRows::end() {
+    return iterator(nullptr);
+}
+
+RenderedRows::iterator::iterator(RenderedRows* rows) : rows(rows) {}
+
+const std::string& RenderedRows::iterator::operator*() const {
+    return rows->line;
+}
+
+const std::string* RenderedRows::iterator::operator->() const {
+    return &rows->line;
+}
+
+RenderedRows::iterator& RenderedRows::iterator::operator++() {
+    if (!rows->advance())
+        rows = nullptr;
+    
+    return *this;
+}
+
+bool RenderedRows::iterator::operator==(const iterator& other) const {
+    return rows == other.rows;
+}
+
+bool RenderedRows::iterator::operator!=(const iterator& other) const {
+    return rows != other.rows;
+}
+
+// ============== RenderJob class ================
+
+RenderJob::~RenderJob() {
+    for (std::thread& worker: workers)
+        if (worker.joinable())
+            worker.join();
+}
+
+size_t RenderJob::size() const {
+    return bands.size();
+}
+
+std::future<std::string>& RenderJob::operator[](size_t i) {
+    return bands[i];
+}
+
+std::vector<std::future<std::string>>::iterator RenderJob::begin() {
+    return bands.begin();
+}
+
+std::vector<std::future<std::string>>::iterator RenderJob::end() {
+    return bands.end();
 }
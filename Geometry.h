@@ -1,12 +1,79 @@
 #ifndef GEOMETRY_H_
 #define GEOMETRY_H_
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include "Profiling.h"
+
+// Coordinate type of every shape and scene, fixed per build: float by
+// default, double with -DGEOMETRY_COORD=double (make COORD=double)
+#ifndef GEOMETRY_COORD
+#define GEOMETRY_COORD float
+#endif
+typedef GEOMETRY_COORD Coord;
+static_assert(std::is_floating_point<Coord>::value,
+              "Coord must be a floating point type: shapes scale and rotate about fractional centres");
+
 class Point;
+class Shape;
+class SpatialIndex;
+class MaskCache;
+class SpanMask;
+class RenderJob;
+struct MaskKey;
+
+
+// Plain query position. Unlike Point it is not a shape: it has no depth or
+// vtable, costs nothing to build and packs densely into arrays. Points
+// convert to it implicitly, so any query taking a Vec2 also takes a Point.
+struct Vec2 {
+	Coord x, y;
+
+	Vec2() = default;
+	constexpr Vec2(Coord x, Coord y) : x(x), y(y) {}
+	Vec2(const Point& p);
+};
+
+static_assert(std::is_trivially_copyable<Vec2>::value, "Vec2 must stay a plain value");
+
+// Axis-aligned bounding box, all edges inclusive
+struct BoundingBox {
+	Coord xmin, ymin, xmax, ymax;
+};
+
+// Inclusive range of cells on one row
+struct Span {
+	int first, last;
+};
+
+// A shape found near a query point and its distance from it
+struct Neighbour {
+	Shape* shape;
+	Coord distance;
+};
+
+// Told of every recorded change to the shapes it watches, see Shape::watch
+class ShapeWatcher {
+
+public:
+	virtual void changed(const Shape& sh) = 0;
+
+protected:
+	~ShapeWatcher() = default;
+};
 
 
 // Abstract class
@@ -20,6 +87,11 @@ public:
 	// Constructor specifying the depth of the object.
 	// If d is negative, throw a std::invalid_argument exception.
 	Shape(int d);
+
+	// Copies start with no watchers. Assigning to an object tells its own
+	// watchers that it changed.
+	Shape(const Shape& other);
+	Shape& operator=(const Shape& other);
     
     // Set depth of object to d. If d is negative, return false and
 	// do not update depth. Otherwise return true
@@ -32,25 +104,105 @@ public:
 	virtual int  dim() const = 0;
     
     // Translate the object by x and y
-	virtual void translate(float x, float y) = 0;
+	virtual void translate(Coord x, Coord y) = 0;
 
     // Rotate the object 90 degrees around its centre    
 	virtual void rotate() = 0;                       
 
      // Scale the object by a factor f relative to its centre
-	virtual void scale(float f) = 0;   
+	virtual void scale(Coord f) = 0;   
 
     // Check if the object contains p             
-	virtual bool contains(const Point& p) const = 0; 
+	virtual bool contains(Vec2 p) const = 0; 
+
+    // Smallest axis-aligned box enclosing the object
+	virtual BoundingBox bounds() const = 0;
+
+    // Batch coverage kernel: for the n sample x-coordinates xs on the line at
+    // height y, set hits[i] to 1 if sample i is covered and 0 otherwise.
+    // Points and line segments have no area, so they cover a one cell wide
+    // footprint (half a unit either side) to stay visible when supersampled.
+	virtual void sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const = 0;
+
+    // Append to spans the ranges of k in [0, count) for which the object
+    // contains Point(x0 + k, y), exactly as contains() would report them
+	virtual void rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const = 0;
+
+    // For MaskCache: describe the object up to a whole-cell translation in
+    // key and store its reference cell in (ox, oy), or return false if its
+    // spans cannot be reused that way. Shapes return false by default.
+	virtual bool maskKey(MaskKey& key, int& ox, int& oy) const;
+
+    // Check if the object and the box have any point in common
+	virtual bool intersects(const BoundingBox& box) const = 0;
+
+    // Check if the object and other have any point in common
+	virtual bool overlaps(const Shape& other) const = 0;
+
+    // Distance from (x, y) to the nearest point of the object, 0 inside it
+	virtual Coord distanceTo(Coord x, Coord y) const = 0;
+
+    // Independent copy of the object
+	virtual std::shared_ptr<Shape> clone() const = 0;
+
+    // Number of changes made to any shape so far. Caches built from shapes
+    // compare it with the value they were built at to spot stale data.
+	static unsigned long changeCount();
+
+    // Tell w of every change recorded on the object from now on, until
+    // unwatch(w). A watcher added n times is told n times and must be
+    // removed n times. Scenes and groups watch the shapes they hold.
+	void watch(ShapeWatcher* w);
+	void unwatch(ShapeWatcher* w);
+
+    // Stamp of the object's current state. It changes whenever the object
+    // does, and objects built separately never share one, so a cache can
+    // tell a changed or replaced object from the one it saw.
+	virtual unsigned long version() const;
     
     // the constant pi
-	static constexpr double PI = 3.1415926;
+	static constexpr Coord PI = Coord(3.1415926);
 
 protected:
+    // Record that the object has changed; every mutator calls this
+    void touch();
+
+    // Tell the watchers that the object has changed, without a new stamp
+    void notify();
+
+    // Give sh a new stamp without counting a change, for a copy that has
+    // become a different object
+    static void restamp(Shape& sh);
+
+    // While one of these lives, changes to sh are not recorded. For copies
+    // only their maker has seen, so moving them into place costs no stamp.
+    class Unrecorded {
+    public:
+        explicit Unrecorded(Shape& sh);
+        ~Unrecorded();
+
+    private:
+        Shape& sh;
+    };
+
+    // Append the span between the analytic edges left and right (relative to
+    // x0), after clipping to [0, count) and nudging both edges onto the
+    // boundary reported by contains()
+    void fitSpan(Coord y, Coord x0, int count, Coord left, Coord right, std::vector<Span>& spans) const;
+
 private:
 
 	//Object depth
     int depth;                                 
+
+    // See version()
+    unsigned long stamp;
+
+    // See Unrecorded
+    bool quiet;
+
+    // See watch()
+    std::vector<ShapeWatcher*> watchers;
 };
 
 
@@ -58,22 +210,30 @@ class Point : public Shape {
 
 public:
 	// Constructor. Depth defaults to 0
-	Point(float x, float y, int d=0);
+	Point(Coord x, Coord y, int d=0);
 
 	// Return basic information (see assignment page)
-	float getX() const;
-	float getY() const;
+	Coord getX() const;
+	Coord getY() const;
 
     // Overrides
     int  dim() const override;
-    void translate(float x, float y) override;
+    void translate(Coord x, Coord y) override;
     void rotate() override;
-    void scale(float f) override;
-    bool contains(const Point& p) const override;
+    void scale(Coord f) override;
+    bool contains(Vec2 p) const override;
+    BoundingBox bounds() const override;
+    void sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool maskKey(MaskKey& key, int& ox, int& oy) const override;
+    bool intersects(const BoundingBox& box) const override;
+    bool overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
 
 private:
     // Coordinates of the point
-    float distX, distY;
+    Coord distX, distY;
 };
 
 
@@ -85,24 +245,32 @@ public:
 	LineSegment(const Point& p, const Point& q);
 
 	// Return basic information (see assignment page)
-	float getXmin() const;
-	float getXmax() const;
-	float getYmin() const;
-	float getYmax() const;
+	Coord getXmin() const;
+	Coord getXmax() const;
+	Coord getYmin() const;
+	Coord getYmax() const;
 
 	// Return the length of the line segment
-	float length() const;
+	Coord length() const;
     
     // Overrides
     int  dim() const override;
-    void translate(float x, float y) override;
+    void translate(Coord x, Coord y) override;
     void rotate() override;
-    void scale(float f) override;
-    bool contains(const Point& p) const override;
+    void scale(Coord f) override;
+    bool contains(Vec2 p) const override;
+    BoundingBox bounds() const override;
+    void sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool maskKey(MaskKey& key, int& ox, int& oy) const override;
+    bool intersects(const BoundingBox& box) const override;
+    bool overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
 
 private:
     // End-points coordinates
-    float x1, y1 , x2, y2;
+    Coord x1, y1 , x2, y2;
 };
 
 
@@ -116,7 +284,7 @@ public:
 	int dim() const override;
     
     // Both rectangle and circle has an area attribute, hence area() declared as virtual to be overriden.
-    virtual float area() const = 0;
+    virtual Coord area() const = 0;
 };
 
 
@@ -125,53 +293,290 @@ class Rectangle : public TwoDShape {
 public:
 	Rectangle(const Point& p, const Point& q);
 
+	// The corner arrays point into the object itself, so copies must not
+	// share them with the original
+	Rectangle(const Rectangle& other);
+	Rectangle& operator=(const Rectangle& other);
+
 	// Get corner coordinates
-	float getXmin() const;
-	float getYmin() const;
-	float getXmax() const;
-	float getYmax() const;
+	Coord getXmin() const;
+	Coord getYmin() const;
+	Coord getXmax() const;
+	Coord getYmax() const;
 
     // Overrides
-    void  translate(float x, float y) override;
+    void  translate(Coord x, Coord y) override;
     void  rotate() override;
-    void  scale(float f) override;
-    bool  contains(const Point& p) const override;
-    float area() const override;
+    void  scale(Coord f) override;
+    bool  contains(Vec2 p) const override;
+    Coord area() const override;
+    BoundingBox bounds() const override;
+    void  sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void  rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool  maskKey(MaskKey& key, int& ox, int& oy) const override;
+    bool  intersects(const BoundingBox& box) const override;
+    bool  overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
 
 private:
-    float x1, y1, x2, y2, x3, y3, x4, y4;
+    Coord x1, y1, x2, y2, x3, y3, x4, y4;
 
-    float *xCoorArray[4] = { &x1, &x2, &x3, &x4 }, *yCoorArray[4] = { &y1, &y2, &y3, &y4 };
+    Coord *xCoorArray[4] = { &x1, &x2, &x3, &x4 }, *yCoorArray[4] = { &y1, &y2, &y3, &y4 };
 };
 
 
 class Circle : public TwoDShape {
 public:
-	Circle(const Point& c, float r);
+	Circle(const Point& c, Coord r);
 
 	// Get center point of the circle
-	float getX() const;
-	float getY() const;
+	Coord getX() const;
+	Coord getY() const;
     
 	// Get radius of the circle
-    float getR() const;
+    Coord getR() const;
 
     // Overrides
-    void  translate(float x, float y) override;
+    void  translate(Coord x, Coord y) override;
     void  rotate() override;
-    void  scale(float f) override;
-    bool  contains(const Point& p) const override;
-	float area() const override;
+    void  scale(Coord f) override;
+    bool  contains(Vec2 p) const override;
+	Coord area() const override;
+    BoundingBox bounds() const override;
+    void  sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void  rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool  maskKey(MaskKey& key, int& ox, int& oy) const override;
+    bool  intersects(const BoundingBox& box) const override;
+    bool  overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
 
 private:
-    float x, y, radius;
+    Coord x, y, radius;
 };
 
 
-class Scene {
+// Which points a polygon whose outline crosses or winds around itself fills:
+// EvenOdd those enclosed an odd number of times, NonZero any point the
+// outline winds around at all
+enum class FillRule { EvenOdd, NonZero };
+
+class Polygon : public TwoDShape {
+public:
+	// Closed outline through the vertices in order, convex or concave. If the
+	// vertices are fewer than three, all on one line or at different depths,
+	// throw a std::invalid_argument exception.
+	Polygon(const std::vector<Point>& vertices, FillRule rule = FillRule::EvenOdd);
+
+	// Get vertex i
+	size_t getSize() const;
+	Coord getX(size_t i) const;
+	Coord getY(size_t i) const;
+
+	FillRule getFillRule() const;
+
+	// Append the ranges of y filled on the vertical line at x, used by the
+	// covered area sweep
+	void columnRanges(double x, std::vector<std::pair<double, double>>& ranges) const;
+
+    // Overrides. Translate, rotate and scale work about the centre of the
+    // bounding box, as for rectangles.
+    void  translate(Coord x, Coord y) override;
+    void  rotate() override;
+    void  scale(Coord f) override;
+    bool  contains(Vec2 p) const override;
+	Coord area() const override;
+    BoundingBox bounds() const override;
+    void  sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void  rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool  intersects(const BoundingBox& box) const override;
+    bool  overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
+
+private:
+    // One side of the outline, from its lower end (ymin, xbottom) to its
+    // upper end (ymax, xtop). winding is +1 going up, -1 going down and 0
+    // for horizontal sides, which never cross a row.
+    struct Edge {
+        Coord ymin, ymax, xbottom, xtop, slope;
+        int winding;
+
+        // x-coordinate of a side that is not horizontal at height y
+        Coord xAt(Coord y) const { return y == ymax ? xtop : xbottom + (y - ymin) * slope; }
+    };
+
+    std::vector<Coord> xs, ys;
+    FillRule rule;
+
+    // Edge table sorted by ymin, so the edges active on a row are found
+    // in a prefix of it
+    std::vector<Edge> edges;
+    BoundingBox box;
+
+    // Rebuild the edge table and bounding box after the vertices move
+    void buildEdges();
+
+    // Filled ranges of x on the row at height y, sorted and inclusive
+    void rowRanges(Coord y, std::vector<std::pair<Coord, Coord>>& ranges) const;
+};
+
+
+// Placement of one copy of an InstanceSet's prototype: scaled by factor and
+// given turns quarter turns about the prototype's centre, then moved by
+// (x, y), just as scale(), rotate() and translate() would on a copy of it
+struct Instance {
+	Coord x, y, factor;
+	int turns;
+};
+
+// Many copies of one shape drawn as a single object at one depth. The set
+// keeps its own copy of the prototype, shared by every placement and every
+// clone of the set, so each copy costs an Instance record rather than a
+// whole shape. Queries map positions back into the prototype's frame;
+// placements that are only moved reuse the prototype's own spans.
+class InstanceSet : public Shape {
+public:
+	// If instances is empty, a factor is not positive or d is negative,
+	// throw a std::invalid_argument exception
+	InstanceSet(const Shape& prototype, const std::vector<Instance>& instances, int d = 0);
+
+	// Get placement i and the shape placed. Placements are kept in order
+	// of their lowest point, so moving the set may renumber them.
+	size_t getSize() const;
+	const Instance& getInstance(size_t i) const;
+	const Shape& getPrototype() const;
+
+	// Independent shape equal to placement i
+	std::shared_ptr<Shape> place(size_t i) const;
+
+    // Overrides. Translate, rotate and scale move every placement as one
+    // object about the centre of the set's bounding box.
+    int   dim() const override;
+    void  translate(Coord x, Coord y) override;
+    void  rotate() override;
+    void  scale(Coord f) override;
+    bool  contains(Vec2 p) const override;
+    BoundingBox bounds() const override;
+    void  sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void  rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool  intersects(const BoundingBox& box) const override;
+    bool  overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
+
+private:
+    std::shared_ptr<const Shape> prototype;
+    std::vector<Instance> instances;
+
+    // Centre and half size of the prototype's bounding box
+    Coord cx, cy, halfWidth, halfHeight;
+    BoundingBox box;
+
+    // Greatest height of any placement, and how far past its bounds a
+    // placement's points and segments reach, bounding how far below a row
+    // the placements reaching it can start
+    Coord tallest, reach;
+
+    // Sort the placements by their lowest point and update the bounds
+    void buildBounds();
+
+    // Placements [first, last) that can reach heights ylo to yhi
+    void placementsIn(Coord ylo, Coord yhi, size_t& first, size_t& last) const;
+
+    // Bounding box of placement in
+    BoundingBox placedBounds(const Instance& in) const;
+
+    // Position in the prototype's frame that placement in moves to p
+    Vec2 toPrototype(const Instance& in, Vec2 p) const;
+
+    // place(i) keeping the prototype's stamp, for copies that live only
+    // within one call
+    std::shared_ptr<Shape> scratch(size_t i) const;
+};
+
+// Node of a scene graph: child shapes, which may be groups themselves,
+// moved together by the group's own transform. A child at local position v
+// is drawn at (x, y) + factor * v turned turns quarter turns anticlockwise
+// about the origin, so moving, turning or scaling the group only updates
+// that transform. The children's bounds are cached in the group's frame,
+// so one test against them culls or accepts the whole subtree. The group
+// is drawn as one object at its own depth; its children's depths are not
+// used.
+class Group : public Shape, private ShapeWatcher {
+public:
+	// Empty group at depth d, with the identity transform
+	Group(int d = 0);
+
+	// Copies clone every child, so they share nothing with the original
+	Group(const Group& other);
+	Group& operator=(const Group& other) = delete;
+	~Group();
+
+	// Add child, given in the group's frame. If child is null or the group
+	// itself, throw a std::invalid_argument exception. The group watches
+	// its children, so a child changed later through another pointer
+	// counts as a change to the group for whoever watches the group.
+	void addChild(std::shared_ptr<Shape> child);
+
+	// Get child i in the group's frame, and an independent copy of it
+	// moved into the scene's frame
+	size_t getSize() const;
+	std::shared_ptr<Shape> getChild(size_t i) const;
+	std::shared_ptr<Shape> place(size_t i) const;
+
+	// Position in the group's frame of the scene position p, and back
+	Vec2 toLocal(Vec2 p) const;
+	Vec2 toWorld(Vec2 v) const;
+
+    // Overrides. Translate, rotate and scale take O(1) time; rotate and
+    // scale work about the centre of the bounding box like the others. The
+    // version also changes when a child does.
+    unsigned long version() const override;
+    int   dim() const override;
+    void  translate(Coord x, Coord y) override;
+    void  rotate() override;
+    void  scale(Coord f) override;
+    bool  contains(Vec2 p) const override;
+    BoundingBox bounds() const override;
+    void  sampleRow(const Coord* xs, int n, Coord y, unsigned char* hits) const override;
+    void  rowSpans(Coord y, Coord x0, int count, std::vector<Span>& spans) const override;
+    bool  intersects(const BoundingBox& box) const override;
+    bool  overlaps(const Shape& other) const override;
+    Coord distanceTo(Coord x, Coord y) const override;
+    std::shared_ptr<Shape> clone() const override;
+
+private:
+    std::vector<std::shared_ptr<Shape>> children;
+
+    // Local transform
+    Coord x, y, factor;
+    int turns;
+
+    // Children's bounds in the group's frame, valid while the latest of the
+    // children's versions still equals localAt. Only read and written
+    // under localLock, as concurrent renders share the group.
+    mutable BoundingBox local;
+    mutable unsigned long localAt;
+    mutable bool localValid;
+    mutable std::mutex localLock;
+
+    BoundingBox localBounds() const;
+
+    // place(i) keeping the child's stamp, for copies that live only within
+    // one call
+    std::shared_ptr<Shape> scratch(size_t i) const;
+
+    // A child changed: pass it on to the group's watchers
+    void changed(const Shape& child) override;
+};
+
+class Scene : private ShapeWatcher {
 
 public:
 	Scene();
+	~Scene();
 
 	// Add the pointer to the collection of pointers stored
 	void addObject(std::shared_ptr<Shape> ptr);
@@ -183,6 +588,100 @@ public:
 	static constexpr int WIDTH = 60;
 	static constexpr int HEIGHT = 20;
 
+	// Collect the shapes operator<< would draw, in drawing order
+	void visibleShapes(std::vector<const Shape*>& shapes) const;
+
+	// Number of changes recorded in the scene: objects added, drawing depth
+	// set and every change to an object it holds
+	unsigned long version() const;
+
+	// Append to changed, oldest first, the object behind each change since
+	// the scene's version was since, null for an object added or the
+	// drawing depth set, and return true. Return false, appending nothing,
+	// if the scene no longer keeps changes that old.
+	bool changesSince(unsigned long since, std::vector<const Shape*>& changed) const;
+
+	// Differs between any two scenes made in one run, unlike their addresses
+	unsigned long id() const;
+
+	// Render a width x height canvas taking samples x samples points per cell
+	// (1 to 8) and store the covered fraction of every cell, row by row from
+	// the top, in coverage. Cell (b, a) is centred on world point (b, height-a-1).
+	void renderCoverage(std::vector<float>& coverage, int samples, int width = WIDTH, int height = HEIGHT) const;
+
+	// As renderCoverage, rasterising each drawn depth layer separately, the
+	// layers being shared out between threads workers. The canvas is drawn
+	// in bands of about BAND_CELLS cells. Each worker merges its layers'
+	// rows of a band into a band buffer of its own of per-sample bits, so no
+	// canvas is shared while rasterising, and the buffers are combined into
+	// coverage before the next band. Coverage is the union of the covered
+	// samples, so the result is renderCoverage's exactly. Besides coverage,
+	// takes 8 bytes per band cell per worker and a row of samples per layer.
+	void renderCoverageByLayer(std::vector<float>& coverage, int samples, unsigned threads = 2,
+	                           int width = WIDTH, int height = HEIGHT) const;
+
+	static constexpr size_t BAND_CELLS = 1 << 16;
+
+	// As renderCoverage, with the fractions quantised to 0 (empty) .. 255 (full)
+	void renderGrayscale(std::vector<unsigned char>& pixels, int samples, int width = WIDTH, int height = HEIGHT) const;
+
+	// Draw the WIDTH x HEIGHT canvas mapping coverage onto ramp, which runs
+	// from the character for an empty cell to the one for a full cell
+	void drawCoverage(std::ostream& out, int samples, const std::string& ramp = " .:-=+*#%@") const;
+
+	// Store in results every shape meeting the box [xmin, xmax] x [ymin, ymax]
+	// whose depth is at most depthFilter, or of any depth if depthFilter is
+	// negative. results is cleared first and keeps its capacity, so repeated
+	// queries into the same vector do not allocate.
+	void queryRange(Coord xmin, Coord ymin, Coord xmax, Coord ymax, int depthFilter, std::vector<Shape*>& results) const;
+
+	// Render the width x height canvas on threads worker threads, in bands
+	// of bandRows rows. Future i of the job becomes ready as soon as band i
+	// is done and holds its rows as operator<< would write them, so output
+	// can start before the whole frame is finished. The scene and its
+	// shapes must stay alive and unchanged until the job is destroyed.
+	RenderJob renderAsync(int bandRows, unsigned threads = 2, int width = WIDTH, int height = HEIGHT) const;
+
+	// Counters and latency histograms gathered so far across all scenes and
+	// threads; all zero unless built with GEOMETRY_STATS (see Profiling.h)
+	static SceneStats stats();
+	static void resetStats();
+
+	// Copy of the scene holding clones of every object. Nothing else refers
+	// to the clones, so the copy never changes unless its owner changes it.
+	std::shared_ptr<Scene> snapshot() const;
+
+	// Store in results the k objects nearest to (x, y), closest first, found
+	// by a best-first search of the spatial index. results is cleared first
+	// and keeps its capacity.
+	void nearest(Coord x, Coord y, size_t k, std::vector<Neighbour>& results) const;
+	std::vector<Neighbour> nearest(Coord x, Coord y, size_t k) const;
+
+	// Store in pairs every pair of objects, of any depth, that overlap.
+	// Candidates come from a sweep and prune over bounding boxes sorted on
+	// xmin and are confirmed with Shape::overlaps. The sweep is shared out
+	// between threads workers. pairs is cleared first and keeps its capacity.
+	void findOverlaps(std::vector<std::pair<Shape*, Shape*>>& pairs, unsigned threads = 1) const;
+
+	// As above, but call report(a, b) for each pair. With more than one
+	// thread report is called concurrently, so it must be thread safe.
+	void findOverlaps(const std::function<void(Shape*, Shape*)>& report, unsigned threads = 1) const;
+
+	// Area covered by the objects operator<< would draw, counting overlaps
+	// once. Only two-dimensional shapes have area. Rectangles alone are
+	// measured exactly by a sweep line in O(n log n). Where circles or
+	// polygons are involved the area is integrated to a relative error of
+	// about tolerance, each cross section visiting every one of them that
+	// spans it: O(n^2 log n) at worst, when many of them overlap in x.
+	double coveredArea(double tolerance = 1e-6) const;
+
+	// As coveredArea, restricted to the drawn objects at depth d
+	double coveredAreaAtDepth(int d, double tolerance = 1e-6) const;
+
+	// coveredAreaAtDepth for every depth with drawn objects, the depth
+	// layers being shared out between threads workers
+	std::map<int, double> coveredAreaByDepth(unsigned threads = 1, double tolerance = 1e-6) const;
+
 private:
     // Once turned on, objects with depths no greater than the drawDepth wil be drawn
     bool hasCustomDepth;
@@ -193,13 +692,286 @@ private:
     // Used map to group objects associated with same depth
     // Mapped int (depth) to list of pointers to Shape object (vector<pointers>) for constant time retrieval O(1)
     std::map< int, std::vector<std::shared_ptr<Shape>> > objectList;
+
+    // Objects held, counting each time one was added
+    size_t objectCount;
+
+    // See id()
+    unsigned long serial;
+
+    // The scene watches its objects and logs each change to one of them, and
+    // logs null for an object added or the drawing depth set. Change number
+    // logStart + k is changeLog[k]; the log drops its older half once it
+    // holds about twice as many changes as there are objects.
+    std::vector<const Shape*> changeLog;
+    unsigned long logStart;
+
+    // Spatial index over every object. It is rebuilt on first use after an
+    // object is added, and otherwise refitted to the shapes logged since
+    // indexedAt. Rebuilt rather than refitted once the log has moved past
+    // indexedAt, or once more shapes have been refitted than it holds, as
+    // refitting loosens the tree. indexLock guards the index and the log.
+    mutable std::unique_ptr<SpatialIndex> index;
+    mutable unsigned long indexedAt;
+    mutable size_t refitted;
+    mutable bool indexValid;
+    mutable std::mutex indexLock;
+
+    const SpatialIndex& spatialIndex() const;
+
+    // Log a change to one of the objects
+    void changed(const Shape& sh) override;
+
+    // Append sh, or null, to the log. The caller holds indexLock.
+    void log(const Shape* sh);
     
 
     // Redirect the coordinate plane to output stream object "out"
     friend std::ostream& operator<<(std::ostream& out, const Scene& s);
 
     // Checks if a cell in the plane should be shaded or marked empty
-    friend bool CheckEmpty(const Scene& s, const Point& p);
+    friend bool CheckEmpty(const Scene& s, Vec2 p);
+};
+
+
+// The kernel behind Scene::renderCoverage, for any window and shape list:
+// store the covered fraction of every cell of a width x height grid, row by
+// row from the top, taking samples x samples points per cell (1 to 8). Cells
+// are cellSize world units square and cell (b, a) is centred on world point
+// (left + b * cellSize, top - a * cellSize). Every shape given is drawn,
+// whatever its depth.
+void rasteriseCoverage(const std::vector<const Shape*>& shapes, int samples, Coord left, Coord top,
+                       Coord cellSize, int width, int height, std::vector<float>& coverage);
+
+// The rows of rasteriseCoverage one at a time, top row first, for canvases
+// too large to hold whole. Shapes are swept in order of their tops, so each
+// row only asks the shapes whose bounds reach it. The shapes must not be
+// changed while a rasteriser is in use.
+class CoverageRasteriser {
+
+public:
+	// Same arguments and exceptions as rasteriseCoverage
+	CoverageRasteriser(const std::vector<const Shape*>& shapes, int samples, Coord left, Coord top,
+	                   Coord cellSize, int width, int height);
+
+	// Store the covered fraction of each cell of the next row in row and
+	// return true, or return false once every row has been produced
+	bool nextRow(std::vector<float>& row);
+
+	// As nextRow, OR-ing instead the bits of each cell's covered samples
+	// into cells[0 .. width - 1], bit j * samples + i being sub-column i of
+	// sub-row j. Only cells that shapes reach are touched, so merging many
+	// sparse layers into one canvas costs little per layer.
+	bool mergeRow(uint64_t* cells);
+
+	// Index of the row last produced, 0 being the top row
+	int row() const;
+
+	int getWidth() const;
+	int getHeight() const;
+
+private:
+    int samples, width, height, current;
+    Coord left, top, cellSize;
+
+    // Shapes and their bounds, highest top first
+    std::vector<const Shape*> shapes;
+    std::vector<BoundingBox> boxes;
+    size_t nextShape;
+
+    // Shapes whose bounds reach the current row, and those bounds
+    std::vector<const Shape*> activeShapes;
+    std::vector<BoundingBox> activeBoxes;
+
+    // Sample x-coordinates, and per-sample hits and per-cell sample bits
+    std::vector<Coord> xs;
+    std::vector<unsigned char> hits;
+    std::vector<uint64_t> masks;
+
+    // Ranges of cells holding the current row's set bits
+    std::vector<Span> touched;
+
+    // Sample the next row into masks, returning false after the last row
+    bool advance();
+};
+
+
+// Hands consistent states of a scene from a writer thread to reader threads.
+// The writer changes its shapes as usual and calls publish() whenever a new
+// state is complete. Readers call acquire() once per frame and render the
+// snapshot they get back, which no one else changes, so rendering needs no
+// locks and never sees a half-finished update. A snapshot is freed when the
+// last reader drops it.
+class SceneSnapshots {
+
+public:
+	SceneSnapshots();
+
+	// Make a snapshot of s the current state. Call from the thread that
+	// changes the shapes of s.
+	void publish(const Scene& s);
+
+	// Latest published state, or an empty scene before the first publish
+	std::shared_ptr<const Scene> acquire() const;
+
+	// Number of states published so far
+	unsigned long version() const;
+
+private:
+    std::shared_ptr<const Scene> current;
+    std::atomic<unsigned long> published;
+};
+
+
+// Finds where a scene's drawing has changed between calls, for renderers
+// that keep rasterised results. A shape counts as changed when its version
+// moves on. Between calls on the same scene only the shapes the scene
+// logged as changed are checked, so an update costs O(changes); objects
+// added, the drawing depth set, a depth changed, or a different scene
+// compare the whole drawing again.
+class ChangeTracker {
+
+public:
+	// Store in dirty the bounds of every shape of s that changed, appeared
+	// or stopped being drawn since the last call; a changed shape adds its
+	// old and new bounds. The first call reports every drawn shape.
+	void update(const Scene& s, std::vector<BoundingBox>& dirty);
+
+	// What operator<< would draw of the scene at the last update, in
+	// drawing order, and the bounds of each
+	const std::vector<const Shape*>& shapes() const;
+	const std::vector<BoundingBox>& boxes() const;
+
+	// Whether sh was drawn at the last update
+	bool isDrawn(const Shape* sh) const;
+
+private:
+	std::vector<const Shape*> drawn, next;
+	std::vector<unsigned long> versions;
+	std::vector<BoundingBox> bounds;
+	std::vector<int> depths;
+
+	// Position of each drawn shape in drawn
+	std::unordered_map<const Shape*, size_t> slots;
+
+	// Scene::id and Scene::version at the last update, 0 before the first
+	unsigned long scene = 0, seen = 0;
+
+	// Scene::changesSince of the last update
+	std::vector<const Shape*> logged;
+};
+
+
+// Produces the covered spans of each canvas row in turn, top row first.
+// Shapes enter and leave an active list as the sweep passes their bounds,
+// so only shapes crossing the current row are asked for spans.
+// The shapes must not be changed while a rasteriser is in use.
+class RowRasteriser {
+
+public:
+	// With a mask cache, shapes that have one take their spans from their
+	// cached masks, so shapes moved by whole cells since the last frame are
+	// not rasterised again
+	RowRasteriser(const Scene& s, int width = Scene::WIDTH, int height = Scene::HEIGHT, MaskCache* masks = nullptr);
+
+	// Store the sorted, merged spans of the next row in spans and return
+	// true, or return false once every row has been produced
+	bool nextRow(std::vector<Span>& spans);
+
+	// Index of the row last produced, 0 being the top row
+	int row() const;
+
+	// Make row the next one to be produced
+	void seek(int row);
+
+	int getWidth() const;
+	int getHeight() const;
+
+private:
+    int width, height, current;
+
+    // Visible shapes ordered by the first row they appear on
+    std::vector<const Shape*> shapes;
+    std::vector<int> firstRows, lastRows;
+    size_t nextShape;
+
+    // Cached mask and reference cell of each shape, if it has one
+    std::vector<std::shared_ptr<const SpanMask>> masks;
+    std::vector<int> originX, originY;
+
+    // Indices of shapes crossing the current row
+    std::vector<size_t> active;
+};
+
+
+
+// Input range over the rows of a rendered canvas, top row first, each row
+// being the '*' and ' ' characters operator<< would write for it. Rows are
+// rendered only as the iterator reaches them, so a consumer that stops
+// early never pays for the rest. The same rules as RowRasteriser apply.
+class RenderedRows {
+
+public:
+	RenderedRows(const Scene& s, int width = Scene::WIDTH, int height = Scene::HEIGHT);
+
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef std::string value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const std::string* pointer;
+		typedef const std::string& reference;
+
+		const std::string& operator*() const;
+		const std::string* operator->() const;
+		iterator& operator++();
+		bool operator==(const iterator& other) const;
+		bool operator!=(const iterator& other) const;
+
+	private:
+		friend class RenderedRows;
+		iterator(RenderedRows* rows);
+
+		// Null once past the last row
+		RenderedRows* rows;
+	};
+
+	// Rendering starts at the row after the last one produced
+	iterator begin();
+	iterator end();
+
+private:
+    RowRasteriser raster;
+    std::vector<Span> spans;
+    std::string line;
+
+    // Render the next row into line, returning false after the last row
+    bool advance();
+};
+
+// Frame being rendered by Scene::renderAsync: a future for each band of
+// rows, top band first, fed by worker threads the job owns. Destroying the
+// job waits for the workers, so none is left reading the scene.
+class RenderJob {
+
+public:
+	RenderJob(RenderJob&& other) = default;
+	RenderJob& operator=(RenderJob&& other) = delete;
+	~RenderJob();
+
+	// Future of band i
+	size_t size() const;
+	std::future<std::string>& operator[](size_t i);
+
+	std::vector<std::future<std::string>>::iterator begin();
+	std::vector<std::future<std::string>>::iterator end();
+
+private:
+	friend class Scene;
+	RenderJob() = default;
+
+    std::vector<std::future<std::string>> bands;
+    std::vector<std::thread> workers;
 };
 
 #endif /* GEOMETRY_H_ */
\ No newline at end of file
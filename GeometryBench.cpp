@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "Canvas.h"
+#include "CoveragePyramid.h"
+#include "FrameExport.h"
+#include "Geometry.h"
+#include "MaskCache.h"
+#include "Viewport.h"
+
+using namespace std;
+
+// Benchmarks for the scene queries on large random scenes. Run as
+// "GeometryBench [shapes]"; the shape count defaults to one million.
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Random mix of points, segments, rectangles and circles over a square
+// world sized so that shapes are sparse, as in a real map
+static void fillScene(Scene& s, vector<shared_ptr<Shape>>& shapes, size_t count, unsigned seed) {
+	mt19937 gen(seed);
+	Coord side = std::sqrt(Coord(count)) * 20;
+	uniform_real_distribution<Coord> pos(0, side), size(1, 15);
+	uniform_int_distribution<int> kind(0, 3), depth(0, 9);
+
+	for (size_t i = 0; i < count; i++) {
+		Coord x = pos(gen), y = pos(gen);
+		int d = depth(gen);
+		shared_ptr<Shape> sh;
+
+		switch (kind(gen)) {
+		case 0: sh = make_shared<Point>(x, y, d); break;
+		case 1: sh = make_shared<LineSegment>(Point(x, y, d), Point(x + size(gen), y, d)); break;
+		case 2: sh = make_shared<Rectangle>(Point(x, y, d), Point(x + size(gen), y + size(gen), d)); break;
+		default: sh = make_shared<Circle>(Point(x, y, d), size(gen)); break;
+		}
+
+		shapes.push_back(sh);
+		s.addObject(sh);
+	}
+}
+
+// k-nearest queries against a linear scan of the same scene
+static void benchNearest(const Scene& s, const vector<shared_ptr<Shape>>& shapes, size_t count) {
+	mt19937 gen(7);
+	Coord side = std::sqrt(Coord(count)) * 20;
+	uniform_real_distribution<Coord> pos(0, side);
+	vector<Neighbour> found;
+
+	auto start = chrono::steady_clock::now();
+	s.nearest(0, 0, 1, found);
+	cout << "nearest: index build " << secondsSince(start) << " s" << endl;
+
+	for (size_t k: { 1, 10, 100 }) {
+		const int QUERIES = 10000;
+		start = chrono::steady_clock::now();
+		for (int q = 0; q < QUERIES; q++)
+			s.nearest(pos(gen), pos(gen), k, found);
+		double indexed = secondsSince(start) / QUERIES;
+
+		const int SCANS = 10;
+		int mismatches = 0;
+		start = chrono::steady_clock::now();
+		for (int q = 0; q < SCANS; q++) {
+			Coord x = pos(gen), y = pos(gen);
+			vector<Coord> dist;
+			for (const auto& sh: shapes)
+				dist.push_back(sh->distanceTo(x, y));
+			nth_element(dist.begin(), dist.begin() + (k - 1), dist.end());
+
+			s.nearest(x, y, k, found);
+			if (found.size() != k || found.back().distance != dist[k - 1])
+				mismatches++;
+		}
+		double scanned = secondsSince(start) / SCANS;
+
+		cout << "nearest k=" << k << ": " << indexed * 1e6 << " us/query, linear scan "
+		     << scanned * 1e6 << " us/query, " << mismatches << " mismatches" << endl;
+	}
+
+	// The scene only hears of changes to its own shapes, and refits the
+	// index to them rather than rebuilding it
+	Circle unrelated(Point(0, 0), 1);
+	start = chrono::steady_clock::now();
+	s.nearest(pos(gen), pos(gen), 10, found);
+	cout << "nearest k=10 after building a shape outside the scene: " << secondsSince(start) * 1e6 << " us" << endl;
+
+	for (size_t moved: { 100, 10000 }) {
+		for (size_t i = 0; i < moved; i++)
+			shapes[(i * 7919) % shapes.size()]->translate(1, 1);
+
+		start = chrono::steady_clock::now();
+		s.nearest(pos(gen), pos(gen), 10, found);
+		cout << "nearest k=10 after moving " << moved << " shapes: " << secondsSince(start) * 1e6 << " us" << endl;
+
+		for (size_t i = 0; i < moved; i++)
+			shapes[(i * 7919) % shapes.size()]->translate(-1, -1);
+	}
+}
+
+// Supersampled coverage of a dense 60 x 20 scene, the path most sensitive
+// to the coordinate type since it evaluates every shape per sample
+static void benchCoverage() {
+	Scene s;
+	vector<shared_ptr<Shape>> shapes;
+	fillScene(s, shapes, 200, 3);
+	for (auto& sh: shapes)
+		sh->scale(Coord(0.05));
+
+	const int FRAMES = 200;
+	vector<float> coverage;
+
+	auto start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++)
+		s.renderCoverage(coverage, 4);
+	double elapsed = secondsSince(start) / FRAMES;
+
+	cout << "coverage 60x20, 4x4 samples: " << elapsed * 1e6 << " us/frame" << endl;
+}
+
+// Zoomed-out view of a 4096 x 4096 world through the pyramid, and the
+// incremental update after moving one shape, against a full rebuild
+static void benchPyramid() {
+	Scene s;
+	vector<shared_ptr<Shape>> shapes;
+	fillScene(s, shapes, 40000, 5);
+
+	auto start = chrono::steady_clock::now();
+	CoveragePyramid pyramid(0, 0, 4096, 2);
+	pyramid.update(s);
+	double built = secondsSince(start);
+
+	vector<float> coverage;
+	start = chrono::steady_clock::now();
+	pyramid.render(coverage, 0, 4096, 16, 256, 256);
+	double rendered = secondsSince(start);
+
+	shapes[0]->translate(3, 3);
+	unsigned long before = pyramid.tilesRasterised();
+	start = chrono::steady_clock::now();
+	pyramid.update(s);
+	double updated = secondsSince(start);
+
+	cout << "pyramid 4096x4096: build " << built * 1e3 << " ms, 256x256 view " << rendered * 1e3
+	     << " ms, one shape moved " << updated * 1e3 << " ms (" << pyramid.tilesRasterised() - before
+	     << " tiles)" << endl;
+}
+
+// A 256 x 128 view panning eight cells a frame across a large world, with
+// its tile cache, against rasterising every frame from scratch
+static void benchViewport(const Scene& s) {
+	const int FRAMES = 100;
+	Viewport view(256, 128, 2);
+	vector<float> coverage;
+	vector<const Shape*> shapes;
+	s.visibleShapes(shapes);
+
+	view.render(s, coverage);
+	auto start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++) {
+		view.pan(8, 0);
+		view.render(s, coverage);
+	}
+	double cached = secondsSince(start) / FRAMES;
+
+	start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++)
+		rasteriseCoverage(shapes, 2, f * 8, 127, 1, 256, 128, coverage);
+	double scratch = secondsSince(start) / FRAMES;
+
+	cout << "viewport 256x128 panning: " << cached * 1e3 << " ms/frame cached ("
+	     << view.tilesRasterised() << " tiles rasterised, " << view.tilesReused() << " reused), "
+	     << scratch * 1e3 << " ms/frame from scratch" << endl;
+
+	// A still view with one shape in it moving back and forth, which only
+	// the tiles under that shape are drawn again for
+	vector<Neighbour> near = s.nearest(view.getLeft() + 128, view.getTop() - 64, 1);
+	unsigned long before = view.tilesRasterised();
+
+	start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++) {
+		near[0].shape->translate(f % 2 ? -1 : 1, 0);
+		view.render(s, coverage);
+	}
+	double moving = secondsSince(start) / FRAMES;
+
+	cout << "viewport 256x128 one shape moving: " << moving * 1e3 << " ms/frame ("
+	     << view.tilesRasterised() - before << " tiles rasterised)" << endl;
+}
+
+// One instanced rectangle placed count times against count separate
+// rectangles, rasterised row by row over a 1000 x 1000 canvas
+static void benchInstances(size_t count) {
+	mt19937 gen(11);
+	uniform_real_distribution<Coord> pos(0, 1000);
+	Rectangle prototype(Point(0, 0), Point(4, 3));
+	vector<Instance> placements;
+	Scene separate, instanced;
+
+	for (size_t i = 0; i < count; i++) {
+		Instance in { std::floor(pos(gen)), std::floor(pos(gen)), 1, 0 };
+		placements.push_back(in);
+
+		auto sh = make_shared<Rectangle>(prototype);
+		sh->translate(in.x, in.y);
+		separate.addObject(sh);
+	}
+	instanced.addObject(make_shared<InstanceSet>(prototype, placements));
+
+	vector<Span> spans;
+	for (Scene* s: { &separate, &instanced }) {
+		auto start = chrono::steady_clock::now();
+		RowRasteriser raster(*s, 1000, 1000);
+		size_t total = 0;
+		while (raster.nextRow(spans))
+			total += spans.size();
+
+		cout << (s == &separate ? "separate" : "instanced") << " rectangles: " << secondsSince(start) * 1e3
+		     << " ms per 1000x1000 raster, " << total << " spans" << endl;
+	}
+
+	cout << "per placement: " << sizeof(Instance) << " bytes instanced, "
+	     << sizeof(Rectangle) + sizeof(shared_ptr<Shape>) << " bytes plus allocation separate" << endl;
+}
+
+// Circles of a few sizes drifting by whole cells each frame, as in
+// main.cpp, rasterised over a 1000 x 1000 canvas with and without masks
+static void benchMasks() {
+	mt19937 gen(13);
+	uniform_real_distribution<Coord> pos(0, 1000);
+	uniform_int_distribution<int> radius(1, 4), step(-3, 3);
+	Scene s;
+	vector<shared_ptr<Shape>> circles;
+
+	for (int i = 0; i < 2000; i++) {
+		auto c = make_shared<Circle>(Point(pos(gen), pos(gen)), Coord(radius(gen) * 10.5));
+		circles.push_back(c);
+		s.addObject(c);
+	}
+
+	const int FRAMES = 20;
+	MaskCache cache;
+	vector<Span> spans;
+
+	for (MaskCache* masks: { (MaskCache*)nullptr, &cache }) {
+		auto start = chrono::steady_clock::now();
+		for (int f = 0; f < FRAMES; f++) {
+			for (auto& c: circles)
+				c->translate(step(gen), step(gen));
+
+			RowRasteriser raster(s, 1000, 1000, masks);
+			while (raster.nextRow(spans)) {}
+		}
+		double elapsed = secondsSince(start) / FRAMES;
+
+		cout << "moving circles " << (masks ? "with" : "without") << " masks: " << elapsed * 1e3 << " ms/frame";
+		if (masks)
+			cout << ", " << cache.hits() << " hits, " << cache.misses() << " misses, " << cache.bytes() / 1024 << " KiB";
+		cout << endl;
+	}
+}
+
+// The fixed-size 60 x 20 Canvas against operator<< on a small HUD scene
+static void benchCanvas() {
+	Scene s;
+	s.addObject(make_shared<Rectangle>(Point(0, 15), Point(10, 19)));
+	s.addObject(make_shared<Circle>(Point(30, 10), 9));
+	s.addObject(make_shared<LineSegment>(Point(0, 0), Point(59, 0)));
+
+	const int FRAMES = 2000;
+	stringstream out;
+
+	auto start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++) {
+		out.str("");
+		out << s;
+	}
+	double reference = secondsSince(start) / FRAMES;
+
+	Canvas<Scene::WIDTH, Scene::HEIGHT> canvas;
+	start = chrono::steady_clock::now();
+	for (int f = 0; f < FRAMES; f++) {
+		out.str("");
+		canvas.render(s);
+		out << canvas;
+	}
+	double fixed = secondsSince(start) / FRAMES;
+
+	cout << "canvas 60x20: operator<< " << reference * 1e6 << " us/frame, Canvas "
+	     << fixed * 1e6 << " us/frame" << endl;
+}
+
+// Coverage of a 2048x2048 window of the main scene, whose shapes are at ten
+// depths, drawn whole and then layer by layer on more and more threads
+// Thread counts past the machine's cores only measure overhead, so they
+// are left out
+static void benchLayers(const Scene& s) {
+	const int SIDE = 2048;
+	vector<float> whole, layered;
+	unsigned cores = max(1u, thread::hardware_concurrency());
+
+	auto start = chrono::steady_clock::now();
+	s.renderCoverage(whole, 2, SIDE, SIDE);
+	cout << "coverage " << SIDE << "x" << SIDE << ", 2x2 samples, " << cores << " cores: whole "
+	     << secondsSince(start) * 1e3 << " ms";
+
+	for (unsigned threads = 1; threads <= min(cores, 8u); threads *= 2) {
+		start = chrono::steady_clock::now();
+		s.renderCoverageByLayer(layered, 2, threads, SIDE, SIDE);
+		cout << ", by layer on " << threads << " threads " << secondsSince(start) * 1e3 << " ms";
+
+		if (layered != whole)
+			cout << " (differs)";
+	}
+	cout << endl;
+}
+
+// Stream buffer that counts what is written and throws it away
+struct CountingBuffer : streambuf {
+	size_t bytes = 0;
+
+	streamsize xsputn(const char*, streamsize n) override {
+		bytes += n;
+		return n;
+	}
+
+	int overflow(int c) override {
+		bytes++;
+		return c;
+	}
+};
+
+// Whole-world images of the main scene, which at a million shapes is about
+// 20000 cells square, streamed to a sink
+static void benchExport(const Scene& s, size_t count) {
+	int side = (int)std::sqrt(Coord(count)) * 20;
+
+	CountingBuffer pbm;
+	ostream pbmOut(&pbm);
+	auto start = chrono::steady_clock::now();
+	writePBM(pbmOut, s, side, side);
+	double pbmTime = secondsSince(start);
+
+	CountingBuffer pgm;
+	ostream pgmOut(&pgm);
+	start = chrono::steady_clock::now();
+	writePGM(pgmOut, s, 1, side, side);
+	double pgmTime = secondsSince(start);
+
+	cout << "export " << side << "x" << side << ": PBM " << pbmTime << " s, " << pbm.bytes / 1048576.0
+	     << " MiB; PGM 1x1 samples " << pgmTime << " s, " << pgm.bytes / 1048576.0 << " MiB" << endl;
+}
+
+int main(int argc, char* argv[]) {
+	size_t count = argc > 1 ? stoul(argv[1]) : 1000000;
+
+	cout << "coordinates: " << sizeof(Coord) * 8 << " bit, sizeof Point/Rectangle/Circle "
+	     << sizeof(Point) << "/" << sizeof(Rectangle) << "/" << sizeof(Circle) << endl;
+
+	Scene s;
+	vector<shared_ptr<Shape>> shapes;
+
+	auto start = chrono::steady_clock::now();
+	fillScene(s, shapes, count, 1);
+	cout << count << " shapes built in " << secondsSince(start) << " s" << endl;
+
+	benchNearest(s, shapes, count);
+	benchViewport(s);
+	benchCoverage();
+	benchPyramid();
+	benchInstances(min(count, (size_t)100000));
+	benchMasks();
+	benchCanvas();
+	benchLayers(s);
+	benchExport(s, count);
+
+	return 0;
+}
@@ -0,0 +1,890 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Canvas.h"
+#include "CoveragePyramid.h"
+#include "FrameExport.h"
+#include "Geometry.h"
+#include "MaskCache.h"
+#include "ShapeFactory.h"
+#include "Viewport.h"
+
+using namespace std;
+
+// Randomised differential check of the optimised render and query paths.
+// Run as "GeometryCheck [scenes] [shapes] [seed]". Each scene is filled with
+// a random mix of every kind of shape and then changed frame after frame by
+// random transforms and draw depths. After every change each fast path is
+// compared with its reference: CheckEmpty cell by cell for '*' frames,
+// one sampleRow call per sample for coverage, linear scans for queries and
+// a fine grid of samples for covered areas.
+// The non-throwing factories are checked against the constructors on a
+// batch of candidates, a few of them invalid, per scene. Last come a frame
+// rasterised while compiling, checked against the same shapes drawn at run
+// time, and a fixed scene of shapes reaching far past the canvas.
+// The run ends with a table of mismatches and speedups per path and exits
+// with status 1 if anything differed.
+
+// Canvas of the full-size frame paths; the 60 x 20 paths (operator<<,
+// Canvas) see its bottom-left corner
+static const int W = 200, H = 100;
+
+// Supersampled window of the coverage paths, kept small because its
+// reference asks every shape about every sample
+static const int CW = 64, CH = 32, SAMPLES = 2;
+
+static const int FRAMES = 8;
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+template<typename F>
+static double timed(F run) {
+	auto start = chrono::steady_clock::now();
+	run();
+	return secondsSince(start);
+}
+
+// Calls, checks, mismatches and time of one path against its reference
+struct Tally {
+	string path, reference;
+	long calls, checks, mismatches;
+	double seconds, referenceSeconds;
+};
+
+static vector<Tally> tallies;
+
+static void record(const string& path, const string& reference, long checks, long mismatches,
+                   double seconds, double referenceSeconds, long calls = 1) {
+	auto it = find_if(tallies.begin(), tallies.end(), [&](const Tally& t) { return t.path == path; });
+	if (it == tallies.end()) {
+		tallies.push_back(Tally { path, reference, 0, 0, 0, 0, 0 });
+		it = tallies.end() - 1;
+	}
+
+	it->calls += calls;
+	it->checks += checks;
+	it->mismatches += mismatches;
+	it->seconds += seconds;
+	it->referenceSeconds += referenceSeconds;
+}
+
+// ---------------------------------------------------------------- scenes
+
+static Coord coordinate(mt19937& gen, Coord lo, Coord hi) {
+	// Mostly whole numbers, since points and segments only show on cells
+	// they pass exactly through
+	Coord v = uniform_real_distribution<Coord>(lo, hi)(gen);
+	return gen() % 4 ? std::floor(v) : v;
+}
+
+static shared_ptr<Shape> randomShape(mt19937& gen, Coord x, Coord y, int d, int kinds) {
+	uniform_real_distribution<Coord> size(1, 12);
+
+	switch (gen() % kinds) {
+	case 0:
+		return make_shared<Point>(x, y, d);
+	case 1: {
+		Coord length = std::ceil(size(gen));
+		return gen() % 2 ? make_shared<LineSegment>(Point(x, y, d), Point(x + length, y, d))
+		                 : make_shared<LineSegment>(Point(x, y, d), Point(x, y + length, d));
+	}
+	case 2:
+		return make_shared<Rectangle>(Point(x, y, d), Point(x + coordinate(gen, 1, 15), y + coordinate(gen, 1, 9), d));
+	case 3:
+		return make_shared<Circle>(Point(x, y, d), size(gen) / 2);
+	case 4:
+		// Draw again until the vertices do not all lie on one line
+		for (;;) {
+			vector<Point> vertices;
+			int n = 3 + gen() % 5;
+			for (int i = 0; i < n; i++)
+				vertices.push_back(Point(x + coordinate(gen, -8, 8), y + coordinate(gen, -8, 8), d));
+
+			try {
+				return make_shared<Polygon>(vertices, gen() % 2 ? FillRule::EvenOdd : FillRule::NonZero);
+			}
+			catch (const invalid_argument&) {}
+		}
+	case 5: {
+		shared_ptr<Shape> prototype = randomShape(gen, 0, 0, 0, 5);
+		vector<Instance> placements;
+		int n = 2 + gen() % 8;
+		for (int i = 0; i < n; i++)
+			placements.push_back(Instance { coordinate(gen, -20, 20), coordinate(gen, -10, 10),
+			                                 gen() % 3 ? Coord(1) : Coord(2), (int)(gen() % 4) });
+		auto set = make_shared<InstanceSet>(*prototype, placements, d);
+		set->translate(x, y);
+		return set;
+	}
+	default: {
+		auto group = make_shared<Group>(d);
+		int n = 2 + gen() % 3;
+		for (int i = 0; i < n; i++)
+			group->addChild(randomShape(gen, coordinate(gen, -10, 10), coordinate(gen, -6, 6), 0, 5));
+		group->translate(x, y);
+		if (gen() % 3 == 0)
+			group->rotate();
+		return group;
+	}
+	}
+}
+
+static void fillScene(Scene& s, vector<shared_ptr<Shape>>& shapes, size_t count, mt19937& gen) {
+	for (size_t i = 0; i < count; i++) {
+		auto sh = randomShape(gen, coordinate(gen, -10, W + 10), coordinate(gen, -10, H + 10), gen() % 6, 7);
+		shapes.push_back(sh);
+		s.addObject(sh);
+	}
+}
+
+// Move, turn and resize a few shapes, sometimes inside a group behind its
+// back, and sometimes change the draw depth
+static void transform(Scene& s, vector<shared_ptr<Shape>>& shapes, mt19937& gen) {
+	for (size_t n = 0; n < shapes.size() / 20 + 1; n++) {
+		shared_ptr<Shape> sh = shapes[gen() % shapes.size()];
+
+		if (Group* group = dynamic_cast<Group*>(sh.get()))
+			if (gen() % 2)
+				sh = group->getChild(gen() % group->getSize());
+
+		switch (gen() % 5) {
+		case 0:
+		case 1: sh->translate((int)(gen() % 11) - 5, (int)(gen() % 11) - 5); break;
+		case 2: sh->translate(coordinate(gen, -2, 2), coordinate(gen, -2, 2)); break;
+		case 3: sh->rotate(); break;
+		default: sh->scale(gen() % 2 ? Coord(2) : Coord(0.5)); break;
+		}
+	}
+
+	if (gen() % 3 == 0)
+		s.setDrawDepth(gen() % 7);
+}
+
+// ---------------------------------------------------------------- frames
+
+typedef vector<char> Frame;
+
+// The reference: one CheckEmpty call per cell, exactly as operator<< does
+static Frame referenceFrame(const Scene& s, int width, int height) {
+	Frame frame(width * height);
+	for (int a = 0; a < height; a++)
+		for (int b = 0; b < width; b++)
+			frame[a * width + b] = CheckEmpty(s, Vec2(b, height - a - 1)) ? '*' : ' ';
+	return frame;
+}
+
+// The 60 x 20 canvas at the bottom-left of a W x H frame
+static Frame corner(const Frame& frame) {
+	Frame small(Scene::WIDTH * Scene::HEIGHT);
+	for (int a = 0; a < Scene::HEIGHT; a++)
+		for (int b = 0; b < Scene::WIDTH; b++)
+			small[a * Scene::WIDTH + b] = frame[(H - Scene::HEIGHT + a) * W + b];
+	return small;
+}
+
+// Rows of text as operator<< writes them, newlines dropped
+static Frame parseRows(const string& text) {
+	Frame frame;
+	for (char c: text)
+		if (c != '\n')
+			frame.push_back(c);
+	return frame;
+}
+
+static Frame rasterFrame(RowRasteriser& raster) {
+	Frame frame(raster.getWidth() * raster.getHeight(), ' ');
+	vector<Span> spans;
+	while (raster.nextRow(spans))
+		for (const Span& span: spans)
+			fill(&frame[raster.row() * raster.getWidth() + span.first],
+			     &frame[raster.row() * raster.getWidth() + span.last] + 1, '*');
+	return frame;
+}
+
+static Frame parseSparse(const string& text) {
+	istringstream in(text);
+	int width, height, row, first, last;
+	in >> width >> height;
+
+	Frame frame(width * height, ' ');
+	while (in >> row >> first >> last)
+		fill(&frame[row * width + first], &frame[row * width + last] + 1, '*');
+	return frame;
+}
+
+// Netpbm header fields up to the single whitespace before the pixels
+static istringstream parseNetpbm(const string& text, string& magic, int& width, int& height) {
+	istringstream in(text);
+	in >> magic >> width >> height;
+	if (magic == "P5") {
+		int maxval;
+		in >> maxval;
+	}
+	in.get();
+	return in;
+}
+
+static Frame parsePBM(const string& text) {
+	string magic;
+	int width, height;
+	istringstream in = parseNetpbm(text, magic, width, height);
+
+	Frame frame(width * height, ' ');
+	int rowBytes = (width + 7) / 8;
+	for (int a = 0; a < height; a++)
+		for (int k = 0; k < rowBytes; k++) {
+			int byte = in.get();
+			for (int bit = 0; bit < 8 && k * 8 + bit < width; bit++)
+				if (byte & (0x80 >> bit))
+					frame[a * width + k * 8 + bit] = '*';
+		}
+	return magic == "P4" && in ? frame : Frame();
+}
+
+// Play the escape sequences FrameDiffWriter sends onto a screen of '*' and
+// ' ' cells, ignoring anything below the frame
+static void playTerminal(const string& text, Frame& screen, int width, int height) {
+	int row = 0, column = 0;
+
+	for (size_t i = 0; i < text.size(); i++) {
+		if (text[i] != '\x1b') {
+			if (row < height && column < width)
+				screen[row * width + column] = text[i];
+			column++;
+			continue;
+		}
+
+		// Cursor moves count rows and columns from 1
+		size_t end = text.find_first_of("HJ", i);
+		if (text[end] == 'H') {
+			sscanf(text.c_str() + i + 2, "%d;%d", &row, &column);
+			row--;
+			column--;
+		}
+		else
+			fill(screen.begin(), screen.end(), ' ');
+		i = end;
+	}
+}
+
+static long differences(const Frame& a, const Frame& b) {
+	if (a.size() != b.size())
+		return max(a.size(), b.size());
+
+	long count = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		count += a[i] != b[i];
+	return count;
+}
+
+// Every '*' frame path against CheckEmpty
+static void checkFrames(const Scene& s, MaskCache& masks, FrameDiffWriter& terminal, Frame& screen) {
+	Frame reference;
+	double referenceTime = timed([&] { reference = referenceFrame(s, W, H); });
+	Frame small = corner(reference);
+	double smallTime = referenceTime * (Scene::WIDTH * Scene::HEIGHT) / (W * H);
+	long cells = reference.size(), smallCells = small.size();
+
+	stringstream out;
+	double t = timed([&] { out << s; });
+	record("operator<< 60x20", "CheckEmpty", smallCells, differences(parseRows(out.str()), small), t, smallTime);
+
+	Canvas<Scene::WIDTH, Scene::HEIGHT> canvas;
+	out.str("");
+	t = timed([&] { canvas.render(s); out << canvas; });
+	record("Canvas<60,20>", "CheckEmpty", smallCells, differences(parseRows(out.str()), small), t, smallTime);
+
+	Frame frame;
+	t = timed([&] { RowRasteriser raster(s, W, H); frame = rasterFrame(raster); });
+	record("RowRasteriser", "CheckEmpty", cells, differences(frame, reference), t, referenceTime);
+
+	t = timed([&] { RowRasteriser raster(s, W, H, &masks); frame = rasterFrame(raster); });
+	record("RowRasteriser+MaskCache", "CheckEmpty", cells, differences(frame, reference), t, referenceTime);
+
+	string rows;
+	t = timed([&] { RenderedRows rendered(s, W, H); for (const string& row: rendered) rows += row; });
+	record("RenderedRows", "CheckEmpty", cells, differences(parseRows(rows), reference), t, referenceTime);
+
+	rows.clear();
+	t = timed([&] { for (auto& band: s.renderAsync(16, 4, W, H)) rows += band.get(); });
+	record("renderAsync 4 threads", "CheckEmpty", cells, differences(parseRows(rows), reference), t, referenceTime);
+
+	out.str("");
+	t = timed([&] { writeSparse(out, s, W, H); });
+	record("writeSparse", "CheckEmpty", cells, differences(parseSparse(out.str()), reference), t, referenceTime);
+
+	out.str("");
+	t = timed([&] { writePBM(out, s, W, H); });
+	record("writePBM", "CheckEmpty", cells, differences(parsePBM(out.str()), reference), t, referenceTime);
+
+	out.str("");
+	t = timed([&] { terminal.write(out, s); });
+	playTerminal(out.str(), screen, W, H);
+	record("FrameDiffWriter", "CheckEmpty", cells, differences(screen, reference), t, referenceTime);
+
+	out.str("");
+	t = timed([&] { out << *s.snapshot(); });
+	record("snapshot operator<<", "CheckEmpty", smallCells, differences(parseRows(out.str()), small), t, smallTime);
+}
+
+// ---------------------------------------------------------------- static frames
+
+// An overlay rasterised while compiling. The circle's edge passes no whole
+// point, where StaticCircle and Circle could differ.
+static constexpr StaticRectangle HUD_BOX { 2, 2, 12, 6 };
+static constexpr StaticCircle HUD_DIAL { 45, 10, 4.5 };
+static constexpr StaticSegment HUD_RULE { 0, 15, 59, 15 };
+static constexpr StaticPoint HUD_MARK { 30, 18 };
+
+static constexpr StaticFrame<Scene::WIDTH, Scene::HEIGHT> HUD =
+	rasteriseStatic<Scene::WIDTH, Scene::HEIGHT>(HUD_BOX, HUD_DIAL, HUD_RULE, HUD_MARK);
+
+// Index in a 60 x 20 frame of world point (x, y)
+static constexpr int hudCell(int x, int y) {
+	return (Scene::HEIGHT - y - 1) * (Scene::WIDTH + 1) + x;
+}
+
+static_assert(HUD.cells[hudCell(2, 2)] == '*' && HUD.cells[hudCell(12, 6)] == '*' &&
+              HUD.cells[hudCell(13, 6)] == ' ' && HUD.cells[hudCell(2, 7)] == ' ', "rectangle");
+static_assert(HUD.cells[hudCell(41, 10)] == '*' && HUD.cells[hudCell(40, 10)] == ' ' &&
+              HUD.cells[hudCell(48, 13)] == '*' && HUD.cells[hudCell(49, 13)] == ' ', "circle");
+static_assert(HUD.cells[hudCell(0, 15)] == '*' && HUD.cells[hudCell(59, 15)] == '*' &&
+              HUD.cells[hudCell(30, 16)] == ' ', "segment");
+static_assert(HUD.cells[hudCell(30, 18)] == '*' && HUD.cells[hudCell(31, 18)] == ' ', "point");
+static_assert(HUD.cells[hudCell(59, 0) + 1] == '\n' && HUD.cells[hudCell(0, 0) - 1] == '\n', "row ends");
+
+// The static frame against operator<< and Canvas on the same shapes as a
+// scene, alone and under a scene drawn on top
+static void checkStatic() {
+	Scene s;
+	s.addObject(make_shared<Rectangle>(Point(2, 2), Point(12, 6)));
+	s.addObject(make_shared<Circle>(Point(45, 10), 4.5));
+	s.addObject(make_shared<LineSegment>(Point(0, 15), Point(59, 15)));
+	s.addObject(make_shared<Point>(30, 18));
+
+	Frame hud = parseRows(string(HUD.cells, sizeof(HUD.cells)));
+	stringstream out;
+	double referenceTime = timed([&] { out << s; });
+	long mismatches = differences(hud, parseRows(out.str()));
+
+	Canvas<Scene::WIDTH, Scene::HEIGHT> canvas;
+	canvas.render(s);
+	out.str("");
+	out << canvas;
+	mismatches += differences(hud, parseRows(out.str()));
+
+	Scene empty;
+	double t = timed([&] { canvas.render(empty, HUD); });
+	out.str("");
+	out << canvas;
+	mismatches += differences(hud, parseRows(out.str()));
+	record("rasteriseStatic", "operator<<", 3 * hud.size(), mismatches, t, referenceTime);
+
+	auto bar = make_shared<Rectangle>(Point(20, 0), Point(26, 19));
+	Scene top;
+	top.addObject(bar);
+	s.addObject(bar);
+
+	out.str("");
+	referenceTime = timed([&] { out << s; });
+	Frame reference = parseRows(out.str());
+
+	t = timed([&] { canvas.render(top, HUD); });
+	out.str("");
+	out << canvas;
+	record("Canvas<60,20> on StaticFrame", "operator<<", hud.size(), differences(parseRows(out.str()), reference), t, referenceTime);
+}
+
+// ---------------------------------------------------------------- coverage
+
+// The reference: one sampleRow call per shape and sample
+static vector<float> referenceCoverage(const vector<const Shape*>& shapes, Coord left, Coord top, Coord cell) {
+	vector<float> coverage(CW * CH);
+
+	for (int a = 0; a < CH; a++)
+		for (int b = 0; b < CW; b++) {
+			int hits = 0;
+			for (int j = 0; j < SAMPLES; j++)
+				for (int i = 0; i < SAMPLES; i++) {
+					Coord x = left + (b + (i + Coord(0.5)) / SAMPLES - Coord(0.5)) * cell;
+					Coord y = top - a * cell + ((j + Coord(0.5)) / SAMPLES - Coord(0.5)) * cell;
+					unsigned char hit = 0;
+					for (size_t k = 0; k < shapes.size() && !hit; k++)
+						shapes[k]->sampleRow(&x, 1, y, &hit);
+					hits += hit;
+				}
+			coverage[a * CW + b] = float(hits) / (SAMPLES * SAMPLES);
+		}
+
+	return coverage;
+}
+
+static long differences(const vector<float>& a, const vector<float>& b) {
+	long count = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		count += !(std::fabs(a[i] - b[i]) <= 1e-6f);
+	return count;
+}
+
+// Coverage paths against per-sample sampling. The viewport pans and zooms
+// at random and, like the pyramid, carries its caches from frame to frame.
+static void checkCoverage(const Scene& s, Viewport& view, CoveragePyramid& pyramid, mt19937& gen) {
+	vector<const Shape*> shapes;
+	s.visibleShapes(shapes);
+
+	vector<float> reference, coverage;
+	double referenceTime = timed([&] { reference = referenceCoverage(shapes, 0, CH - 1, 1); });
+
+	double t = timed([&] { s.renderCoverage(coverage, SAMPLES, CW, CH); });
+	record("renderCoverage", "per-sample", reference.size(), differences(coverage, reference), t, referenceTime);
+
+	t = timed([&] { s.renderCoverageByLayer(coverage, SAMPLES, 4, CW, CH); });
+	record("renderCoverageByLayer 4 thr", "per-sample", reference.size(), differences(coverage, reference), t, referenceTime);
+
+	t = timed([&] { pyramid.update(s); pyramid.render(coverage, -0.5, CH - 0.5, 1, CW, CH); });
+	record("CoveragePyramid", "per-sample", reference.size(), differences(coverage, reference), t, referenceTime);
+
+	// The image holds 255 minus the quantised coverage
+	stringstream out;
+	t = timed([&] { writePGM(out, s, SAMPLES, CW, CH); });
+	string magic;
+	int width, height;
+	istringstream in = parseNetpbm(out.str(), magic, width, height);
+	long mismatches = magic != "P5" || width != CW || height != CH;
+	for (float covered: reference)
+		mismatches += in.get() != 255 - lround(covered * 255);
+	record("writePGM", "per-sample", reference.size(), mismatches, t, referenceTime);
+
+	if (gen() % 4 == 0) {
+		int zoom = (int)(gen() % 3) - 1;
+		if (view.getZoom() + zoom >= -1 && view.getZoom() + zoom <= 1)
+			view.zoom(zoom);
+	}
+	view.pan(coordinate(gen, -40, 40), coordinate(gen, -20, 20));
+
+	t = timed([&] { view.render(s, coverage); });
+	reference = referenceCoverage(shapes, view.getLeft(), view.getTop(), view.getCellSize());
+	record("Viewport", "per-sample", reference.size(), differences(coverage, reference), t, referenceTime);
+}
+
+// ---------------------------------------------------------------- queries
+
+// Squares of side AREA_STEP sampled at their centres for the area reference.
+// Edges on whole numbers fall between samples, but other straight edges
+// along the grid gain or lose up to half a step over their whole length.
+// At 1/32 that leaves the sampled area within about 1.1e-3 of the exact
+// one, relatively.
+static const double AREA_STEP = 1.0 / 32, AREA_TOLERANCE = 2e-3;
+
+// The reference for coveredAreaByDepth: the two-dimensional parts of each
+// depth's shapes, with sets and groups taken apart into placed copies,
+// sampled at the centres of a fine grid of squares
+static map<int, double> referenceAreas(const Scene& s) {
+	vector<const Shape*> shapes;
+	s.visibleShapes(shapes);
+
+	map<int, vector<const Shape*>> layers;
+	vector<shared_ptr<Shape>> placed;
+	function<void(const Shape&, int)> add = [&](const Shape& sh, int depth) {
+		const InstanceSet* set = dynamic_cast<const InstanceSet*>(&sh);
+		const Group* group = dynamic_cast<const Group*>(&sh);
+		size_t count = set ? set->getSize() : group ? group->getSize() : 0;
+
+		for (size_t i = 0; i < count; i++) {
+			placed.push_back(set ? set->place(i) : group->place(i));
+			add(*placed.back(), depth);
+		}
+		if (!set && !group && sh.dim() == 2)
+			layers[depth].push_back(&sh);
+	};
+	for (const Shape* sh: shapes)
+		add(*sh, sh->getDepth());
+
+	map<int, double> areas;
+	for (const auto& layer: layers) {
+		BoundingBox all = layer.second[0]->bounds();
+		for (const Shape* sh: layer.second) {
+			BoundingBox b = sh->bounds();
+			all = BoundingBox { min(all.xmin, b.xmin), min(all.ymin, b.ymin), max(all.xmax, b.xmax), max(all.ymax, b.ymax) };
+		}
+
+		double x0 = floor(all.xmin), y0 = floor(all.ymin);
+		int cols = (int)ceil((all.xmax - x0) / AREA_STEP) + 1, rows = (int)ceil((all.ymax - y0) / AREA_STEP) + 1;
+		vector<unsigned char> covered((size_t)cols * rows, 0);
+		long count = 0;
+
+		for (const Shape* sh: layer.second) {
+			BoundingBox b = sh->bounds();
+			int i0 = max(0, (int)ceil((b.xmin - x0) / AREA_STEP - 0.5)), i1 = min(cols - 1, (int)floor((b.xmax - x0) / AREA_STEP - 0.5));
+			int j0 = max(0, (int)ceil((b.ymin - y0) / AREA_STEP - 0.5)), j1 = min(rows - 1, (int)floor((b.ymax - y0) / AREA_STEP - 0.5));
+
+			for (int j = j0; j <= j1; j++)
+				for (int i = i0; i <= i1; i++) {
+					unsigned char& cell = covered[(size_t)j * cols + i];
+					if (!cell && sh->contains(Vec2(Coord(x0 + (i + 0.5) * AREA_STEP), Coord(y0 + (j + 0.5) * AREA_STEP)))) {
+						cell = 1;
+						count++;
+					}
+				}
+		}
+		areas[layer.first] = count * AREA_STEP * AREA_STEP;
+	}
+
+	return areas;
+}
+
+static void checkQueries(const Scene& s, const vector<shared_ptr<Shape>>& shapes, bool overlaps, mt19937& gen) {
+	const int QUERIES = 20;
+	long mismatches = 0;
+	double t = 0, referenceTime = 0;
+	vector<Shape*> found, expected;
+
+	for (int q = 0; q < QUERIES; q++) {
+		Coord x = coordinate(gen, -10, W), y = coordinate(gen, -10, H);
+		BoundingBox box { x, y, x + coordinate(gen, 0, 30), y + coordinate(gen, 0, 20) };
+		int depth = (int)(gen() % 7) - 1;
+
+		t += timed([&] { s.queryRange(box.xmin, box.ymin, box.xmax, box.ymax, depth, found); });
+		referenceTime += timed([&] {
+			expected.clear();
+			for (const auto& sh: shapes)
+				if ((depth < 0 || sh->getDepth() <= depth) && sh->intersects(box))
+					expected.push_back(sh.get());
+		});
+
+		sort(found.begin(), found.end());
+		sort(expected.begin(), expected.end());
+		mismatches += found != expected;
+	}
+	record("queryRange", "linear scan", QUERIES, mismatches, t, referenceTime, QUERIES);
+
+	mismatches = 0;
+	t = referenceTime = 0;
+	vector<Neighbour> nearest;
+	vector<Coord> distances;
+
+	for (int q = 0; q < QUERIES; q++) {
+		Coord x = coordinate(gen, -10, W), y = coordinate(gen, -10, H);
+		size_t k = min(shapes.size(), (size_t)(1 + gen() % 10));
+
+		t += timed([&] { s.nearest(x, y, k, nearest); });
+		referenceTime += timed([&] {
+			distances.clear();
+			for (const auto& sh: shapes)
+				distances.push_back(sh->distanceTo(x, y));
+			partial_sort(distances.begin(), distances.begin() + k, distances.end());
+		});
+
+		bool same = nearest.size() == k;
+		for (size_t i = 0; same && i < k; i++)
+			same = nearest[i].distance == distances[i];
+		mismatches += !same;
+	}
+	record("nearest", "linear scan", QUERIES, mismatches, t, referenceTime, QUERIES);
+
+	if (!overlaps)
+		return;
+
+	// Pairs as sorted (lower, higher) address pairs
+	typedef vector<pair<Shape*, Shape*>> Pairs;
+	auto normalise = [](Pairs& pairs) {
+		for (auto& p: pairs)
+			if (p.second < p.first)
+				swap(p.first, p.second);
+		sort(pairs.begin(), pairs.end());
+	};
+
+	Pairs brute, pairs;
+	referenceTime = timed([&] {
+		for (size_t i = 0; i < shapes.size(); i++)
+			for (size_t j = i + 1; j < shapes.size(); j++)
+				if (shapes[i]->overlaps(*shapes[j]))
+					brute.push_back(make_pair(shapes[i].get(), shapes[j].get()));
+	});
+	normalise(brute);
+
+	for (unsigned threads: { 1u, 4u }) {
+		t = timed([&] { s.findOverlaps(pairs, threads); });
+		normalise(pairs);
+		record(threads == 1 ? "findOverlaps" : "findOverlaps 4 threads", "all pairs", 1, pairs != brute, t, referenceTime);
+	}
+
+	map<int, double> areas, sampled;
+	t = timed([&] { areas = s.coveredAreaByDepth(4); });
+	referenceTime = timed([&] { sampled = referenceAreas(s); });
+	mismatches = 0;
+	for (const auto& area: areas) {
+		double e = sampled.count(area.first) ? sampled[area.first] : 0;
+		mismatches += !(std::fabs(area.second - e) <= AREA_TOLERANCE * std::max(1.0, e));
+	}
+	record("coveredAreaByDepth 4 threads", "sampled", areas.size(), mismatches, t, referenceTime);
+}
+
+// ---------------------------------------------------------------- factories
+
+// Mostly valid candidates, with every way of being invalid now and then
+static void fillBatch(ShapeBatch& batch, size_t count, mt19937& gen) {
+	uniform_int_distribution<int> kind(0, 3), length(1, 10), percent(0, 99);
+	batch.clear();
+
+	for (size_t i = 0; i < count; i++) {
+		Coord x = coordinate(gen, 0, W), y = coordinate(gen, 0, H);
+		int d1 = percent(gen) == 0 ? -1 : length(gen), d2 = percent(gen) == 0 ? d1 + 1 : d1;
+		Coord w = percent(gen) == 0 ? 0 : length(gen), h = percent(gen) == 0 ? 0 : length(gen);
+
+		switch (kind(gen)) {
+		case 0: batch.add(ShapeKind::Point, x, y, 0, 0, d1); break;
+		case 1:
+			// Axis-aligned unless both or neither of w and h were zeroed
+			if (percent(gen) < 50)
+				batch.add(ShapeKind::LineSegment, x, y, x + w, y + (w == 0 ? 0 : h) * (h == 0), d1, d2);
+			else
+				batch.add(ShapeKind::LineSegment, x, y, x + (h == 0 ? 0 : w) * (w == 0), y + h, d1, d2);
+			break;
+		case 2: batch.add(ShapeKind::Rectangle, x, y, x + w, y - h, d1, d2); break;
+		default: batch.add(ShapeKind::Circle, x, y, percent(gen) == 0 ? -w : w, 0, d1); break;
+		}
+	}
+}
+
+// Candidate i built with the constructors, or null where they throw
+static shared_ptr<Shape> construct(const ShapeBatch& batch, size_t i) {
+	try {
+		Point p(batch.x1[i], batch.y1[i], batch.d1[i]);
+
+		switch (batch.kind[i]) {
+		case ShapeKind::Point: return make_shared<Point>(p);
+		case ShapeKind::LineSegment: return make_shared<LineSegment>(p, Point(batch.x2[i], batch.y2[i], batch.d2[i]));
+		case ShapeKind::Rectangle: return make_shared<Rectangle>(p, Point(batch.x2[i], batch.y2[i], batch.d2[i]));
+		default: return make_shared<Circle>(p, batch.x2[i]);
+		}
+	}
+	catch (const invalid_argument&) {
+		return nullptr;
+	}
+}
+
+// Candidate i built with the factories; error says why not
+static shared_ptr<Shape> make(const ShapeBatch& batch, size_t i, ShapeError& error) {
+	ShapeKind kind = batch.kind[i];
+
+	if (kind == ShapeKind::Point) {
+		ShapeResult<Point> p = makePoint(batch.x1[i], batch.y1[i], batch.d1[i]);
+		error = p.error;
+		return p.shape;
+	}
+
+	// Points themselves only refuse negative depths
+	bool two = kind != ShapeKind::Circle;
+	if (batch.d1[i] < 0 || (two && batch.d2[i] < 0)) {
+		error = ShapeError::NegativeDepth;
+		return nullptr;
+	}
+
+	Point p(batch.x1[i], batch.y1[i], batch.d1[i]);
+	if (!two) {
+		ShapeResult<Circle> c = makeCircle(p, batch.x2[i]);
+		error = c.error;
+		return c.shape;
+	}
+
+	Point q(batch.x2[i], batch.y2[i], batch.d2[i]);
+	if (kind == ShapeKind::LineSegment) {
+		ShapeResult<LineSegment> l = makeLineSegment(p, q);
+		error = l.error;
+		return l.shape;
+	}
+
+	ShapeResult<Rectangle> r = makeRectangle(p, q);
+	error = r.error;
+	return r.shape;
+}
+
+static bool sameBounds(const Shape& a, const Shape& b) {
+	BoundingBox p = a.bounds(), q = b.bounds();
+	return p.xmin == q.xmin && p.ymin == q.ymin && p.xmax == q.xmax && p.ymax == q.ymax &&
+	       a.getDepth() == b.getDepth();
+}
+
+// Both or neither made, and alike if made
+static bool agree(const shared_ptr<Shape>& a, const shared_ptr<Shape>& b) {
+	return a && b ? sameBounds(*a, *b) : !a == !b;
+}
+
+// Every factory path against the constructors on one batch
+static void checkFactories(size_t count, mt19937& gen) {
+	ShapeBatch batch;
+	fillBatch(batch, count, gen);
+	size_t n = batch.size();
+
+	vector<shared_ptr<Shape>> reference(n), made(n), built;
+	vector<ShapeError> madeErrors(n), errors;
+
+	double referenceTime = timed([&] {
+		for (size_t i = 0; i < n; i++)
+			reference[i] = construct(batch, i);
+	});
+
+	double t = timed([&] {
+		for (size_t i = 0; i < n; i++)
+			made[i] = make(batch, i, madeErrors[i]);
+	});
+	long mismatches = 0;
+	for (size_t i = 0; i < n; i++)
+		mismatches += !agree(made[i], reference[i]) || (madeErrors[i] == ShapeError::None) != !!made[i];
+	record("make* factories", "constructors", n, mismatches, t, referenceTime);
+
+	// The validator and the factories must also give the same reasons
+	t = timed([&] { validateShapes(batch, errors); });
+	mismatches = 0;
+	for (size_t i = 0; i < n; i++)
+		mismatches += errors[i] != madeErrors[i];
+	record("validateShapes", "constructors", n, mismatches, t, referenceTime);
+
+	t = timed([&] { buildShapes(batch, built, errors); });
+	mismatches = 0;
+	for (size_t i = 0; i < n; i++)
+		mismatches += !agree(built[i], reference[i]);
+	record("buildShapes", "constructors", n, mismatches, t, referenceTime);
+
+	// Scaling the valid shapes by factors that are sometimes not positive
+	uniform_int_distribution<int> factor(-1, 3);
+	vector<Coord> factors(n);
+	for (Coord& f: factors)
+		f = factor(gen) / Coord(2);
+
+	vector<char> threw(n);
+	referenceTime = timed([&] {
+		for (size_t i = 0; i < n; i++) {
+			if (!reference[i])
+				continue;
+			try {
+				reference[i]->scale(factors[i]);
+			}
+			catch (const invalid_argument&) {
+				threw[i] = 1;
+			}
+		}
+	});
+
+	mismatches = 0;
+	t = timed([&] {
+		for (size_t i = 0; i < n; i++)
+			if (built[i] && (tryScale(*built[i], factors[i]) == ShapeError::BadScale) != (threw[i] == 1))
+				mismatches++;
+	});
+	for (size_t i = 0; i < n; i++)
+		mismatches += !agree(built[i], reference[i]);
+	record("tryScale", "scale()", n, mismatches, t, referenceTime);
+}
+
+// ---------------------------------------------------------------- oversized
+
+// Bands reaching far past any canvas, plain and inside a group and an
+// instance set that are sampled cell by cell, and shapes far taller or
+// wider than the canvas, through every frame and coverage path and a
+// viewport zoomed all the way in
+static void checkOversized(MaskCache& masks, mt19937& gen) {
+	const Coord FAR = 1e10;
+	Scene s;
+	s.addObject(make_shared<Rectangle>(Point(-FAR, 10), Point(FAR, 14)));
+
+	auto group = make_shared<Group>(1);
+	group->addChild(make_shared<Rectangle>(Point(-FAR, 0), Point(FAR, 3)));
+	group->scale(2);
+	group->translate(0, 30);
+	s.addObject(group);
+
+	vector<Instance> placements { Instance { 0, 50, 2, 0 }, Instance { 40, 0, 1, 1 } };
+	s.addObject(make_shared<InstanceSet>(Rectangle(Point(-FAR, 0), Point(FAR, 2)), placements, 2));
+
+	// Shapes with mask keys: a column too tall to mask in full, and a band
+	// too wide to count its columns in an int
+	s.addObject(make_shared<Rectangle>(Point(2, -300000), Point(5, 300000)));
+	s.addObject(make_shared<Rectangle>(Point(-1073741760, 40), Point(1073741760, 44)));
+
+	FrameDiffWriter terminal(W, H);
+	Frame screen(W * H, ' ');
+	Viewport view(CW, CH, SAMPLES, 16);
+	CoveragePyramid pyramid(0, 0, 64, SAMPLES);
+
+	checkFrames(s, masks, terminal, screen);
+	checkCoverage(s, view, pyramid, gen);
+
+	// Cells of 1/256 put the band ends trillions of cells away
+	vector<const Shape*> shapes;
+	s.visibleShapes(shapes);
+
+	Viewport close(CW, CH, SAMPLES, 16);
+	close.zoom(Viewport::MAX_ZOOM);
+	close.pan(0, 10 - (CH - 1) / Coord(2));
+
+	vector<float> coverage;
+	double t = timed([&] { close.render(s, coverage); });
+	vector<float> reference;
+	double referenceTime = timed([&] { reference = referenceCoverage(shapes, close.getLeft(), close.getTop(), close.getCellSize()); });
+	record("Viewport", "per-sample", reference.size(), differences(coverage, reference), t, referenceTime);
+}
+
+// ---------------------------------------------------------------- main
+
+int main(int argc, char* argv[]) {
+	int scenes = argc > 1 ? stoi(argv[1]) : 4;
+	size_t count = argc > 2 ? stoul(argv[2]) : 2000;
+	unsigned seed = argc > 3 ? stoul(argv[3]) : 1;
+
+	mt19937 gen(seed);
+	MaskCache masks;
+
+	for (int n = 0; n < scenes; n++) {
+		Scene s;
+		vector<shared_ptr<Shape>> shapes;
+		fillScene(s, shapes, count, gen);
+
+		checkFactories(count * 10, gen);
+
+		FrameDiffWriter terminal(W, H);
+		Frame screen(W * H, ' ');
+		Viewport view(CW, CH, SAMPLES, 16);
+		CoveragePyramid pyramid(0, 0, 64, SAMPLES);
+
+		for (int f = 0; f < FRAMES; f++) {
+			checkFrames(s, masks, terminal, screen);
+			checkCoverage(s, view, pyramid, gen);
+			checkQueries(s, shapes, f == 0 || f == FRAMES - 1, gen);
+			transform(s, shapes, gen);
+		}
+	}
+
+	checkStatic();
+	checkOversized(masks, gen);
+
+	long failed = 0;
+	cout << left << setw(30) << "path" << setw(14) << "reference" << right << setw(10) << "checks"
+	     << setw(12) << "mismatches" << setw(12) << "us/call" << setw(10) << "speedup" << endl;
+
+	for (const Tally& t: tallies) {
+		cout << left << setw(30) << t.path << setw(14) << t.reference << right << setw(10) << t.checks
+		     << setw(12) << t.mismatches << setw(12) << fixed << setprecision(1) << t.seconds / t.calls * 1e6
+		     << setw(9) << setprecision(1) << t.referenceSeconds / t.seconds << "x" << endl;
+		failed += t.mismatches;
+	}
+
+	cout << (failed ? "FAILED: " : "all paths match, ") << failed << " mismatches over " << scenes << " scenes of "
+	     << count << " shapes, seed " << seed << endl;
+
+	return failed ? 1 : 0;
+}
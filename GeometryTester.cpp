@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 #include "Geometry.h"
@@ -978,10 +985,154 @@ void GeometryTester::testy() {
 	passOut_();
 }
 
-// reserved for new test cases
-void GeometryTester::testz() {
+// Timings, in microseconds, of repeated runs of one workload
+struct Timing {
+	double fastest, median, p99;
+};
+
+// Run work WARMUPS times untimed, then RUNS times timed. With 101 runs the
+// p99 is the second slowest, so one stray pause does not decide it.
+static Timing timeRuns(const function<void()>& work) {
+	const int WARMUPS = 3, RUNS = 101;
+
+	for(int i=0;i<WARMUPS;i++) work();
+
+	vector<double> times;
+	for(int i=0;i<RUNS;i++) {
+		auto start = chrono::steady_clock::now();
+		work();
+		times.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+	}
+
+	// Nearest-rank percentiles
+	sort(times.begin(), times.end());
+	return Timing { times[0], times[RUNS / 2], times[(RUNS * 99 + 99) / 100 - 1] };
+}
+
+// Scene of count random points, segments, rectangles and circles at
+// depths 0 to 9 over a width x height world, the same for every run
+static void perfScene(Scene& s, int count, int width, int height) {
+	mt19937 gen(47);
+	uniform_real_distribution<float> x(0, width), y(0, height), size(1, 8);
+	uniform_int_distribution<int> kind(0, 3), depth(0, 9);
+
+	for(int i=0;i<count;i++) {
+		Coord px = x(gen), py = y(gen), w = size(gen), h = size(gen);
+		int d = depth(gen);
+
+		switch (kind(gen)) {
+		case 0: s.addObject(make_shared<Point>(px, py, d)); break;
+		case 1: s.addObject(make_shared<LineSegment>(Point(px, py, d), Point(px + w, py, d))); break;
+		case 2: s.addObject(make_shared<Rectangle>(Point(px, py, d), Point(px + w, py + h, d))); break;
+		default: s.addObject(make_shared<Circle>(Point(px, py, d), w / 2)); break;
+		}
+	}
+}
+
+// Performance: time fixed render and query workloads and compare them with
+// the baselines in PERF_BASELINES, or write those baselines if record is set.
+// A workload fails if its fastest run is more than TOLERANCE over its
+// baseline's, or its p99 twice that. Noise only ever adds time, so the
+// fastest run moves least between runs of the same build. Recording keeps
+// the fastest run and the slowest p99 of RECORD_PASSES passes, so the p99
+// baseline has room for the pauses one pass may miss. Baselines only hold
+// for the machine and build options they were recorded with.
+void GeometryTester::testz(bool record) {
 	funcname_ = "GeometryTester::testz";
 
+	const char* PERF_BASELINES = "PerfBaselines.txt";
+	const double TOLERANCE = 0.5;
+	const int W = 400, H = 200, QUERIES = 500, RECORD_PASSES = 3;
+
+	// operator<< tests every shape for every cell, so its scene only covers
+	// the page. One page takes about a tenth of the other workloads, so it
+	// is drawn PAGES times to stand clear of timer noise.
+	const int PAGES = 10;
+	Scene s, page;
+	perfScene(s, 20000, W, H);
+	perfScene(page, 1000, Scene::WIDTH, Scene::HEIGHT);
+
+	// Query positions, also fixed
+	mt19937 gen(1);
+	uniform_real_distribution<float> qx(0, W), qy(0, H), qsize(1, 20);
+	vector<BoundingBox> boxes;
+	for(int i=0;i<QUERIES;i++) {
+		Coord x = qx(gen), y = qy(gen);
+		boxes.push_back(BoundingBox { x, y, x + qsize(gen), y + qsize(gen) });
+	}
+
+	vector<Span> spans;
+	vector<float> coverage;
+	vector<Shape*> found;
+	vector<Neighbour> near;
+	vector<pair<Shape*, Shape*>> pairs;
+	stringstream out;
+
+	vector<pair<string, function<void()>>> workloads {
+		{ "page", [&] { for(int i=0;i<PAGES;i++) { out.str(""); out << page; } } },
+		{ "raster", [&] { RowRasteriser r(s, W, H); while (r.nextRow(spans)); } },
+		{ "coverage", [&] { s.renderCoverage(coverage, 2, W, H); } },
+		{ "range", [&] { for (const BoundingBox& b: boxes) s.queryRange(b.xmin, b.ymin, b.xmax, b.ymax, -1, found); } },
+		{ "nearest", [&] { for (const BoundingBox& b: boxes) s.nearest(b.xmin, b.ymin, 10, near); } },
+		{ "overlaps", [&] { pairs.clear(); s.findOverlaps(pairs); } },
+	};
+
+	map<string, Timing> baselines;
+	if (!record) {
+		ifstream in(PERF_BASELINES);
+		string line, name;
+		Timing t;
+		while (getline(in, line)) {
+			istringstream fields(line);
+			if (line[0] != '#' && fields >> name >> t.fastest >> t.median >> t.p99)
+				baselines[name] = t;
+		}
+	}
+
+	ostringstream recorded;
+	recorded << "# workload fastest_us median_us p99_us, from GeometryTesterMain Z\n";
+
+	for(size_t i=0;i<workloads.size();i++) {
+		const string& name = workloads[i].first;
+		Timing t = timeRuns(workloads[i].second);
+		for(int pass=1;record && pass<RECORD_PASSES;pass++) {
+			Timing u = timeRuns(workloads[i].second);
+			t = Timing { min(t.fastest, u.fastest), min(t.median, u.median), max(t.p99, u.p99) };
+		}
+
+		cout << left << setw(10) << name << right << fixed << setprecision(1)
+		     << " fastest " << setw(10) << t.fastest << " us  median " << setw(10) << t.median
+		     << " us  p99 " << setw(10) << t.p99 << " us";
+		recorded << name << " " << t.fastest << " " << t.median << " " << t.p99 << "\n";
+
+		if (record) {
+			cout << endl;
+			continue;
+		}
+
+		auto base = baselines.find(name);
+		if (base == baselines.end()) {
+			cout << endl;
+			errorOut_("no baseline, record one with GeometryTesterMain Z: ", name, i + 1);
+			continue;
+		}
+
+		cout << "  baseline " << base->second.fastest << " / " << base->second.p99 << " us" << endl;
+		if (t.fastest > base->second.fastest * (1 + TOLERANCE))
+			errorOut_("fastest run over baseline: ", name, i + 1);
+		if (t.p99 > base->second.p99 * (1 + 2 * TOLERANCE))
+			errorOut_("p99 over baseline: ", name, i + 1);
+	}
+	cout.unsetf(ios::floatfield);
+
+	if (record) {
+		ofstream file(PERF_BASELINES);
+		file << recorded.str();
+		if (!file)
+			errorOut_("could not write ", PERF_BASELINES, 0);
+	}
+
+	passOut_();
 }
 
 void GeometryTester::errorOut_(const string& errMsg, unsigned int errBit) {
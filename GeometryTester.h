@@ -47,8 +47,8 @@ public:
 	void testx();
 	void testy();
 
-	// unused
-	void testz();
+	// performance against stored baselines, or record them
+	void testz(bool record = false);
 
 private:
 
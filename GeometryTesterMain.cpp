@@ -34,7 +34,8 @@ int main(int argc, char* argv[]) {
 		case 'x': { GeometryTester t; t.testx(); } break;
 		case 'y': { GeometryTester t; t.testy(); } break;
 		case 'z': { GeometryTester t; t.testz(); } break;
-		default: { cout << "Options are a -- y." << endl; } break;
+		case 'Z': { GeometryTester t; t.testz(true); } break;
+		default: { cout << "Options are a -- y, z to time against the baselines, Z to record them." << endl; } break;
 	       	}
 	}
 	return 0;
@@ -0,0 +1,178 @@
+#include <cmath>
+#include <algorithm>
+
+#include "MaskCache.h"
+
+bool MaskKey::operator==(const MaskKey& other) const {
+    return kind == other.kind && across == other.across && up == other.up &&
+           a == other.a && b == other.b && c == other.c && d == other.d;
+}
+
+bool MaskKey::split(Coord v, int& n, Coord& f) {
+    if (!(std::fabs(v) < Coord(1 << 30)))
+        return false;
+
+    Coord whole = std::floor(v);
+    f = v - whole;
+    n = (int)whole;
+
+    // The subtraction is exact unless v is a small negative number
+    return v >= 0 || v <= -1 || f - 1 == v;
+}
+
+void SpanMask::rowSpans(int ox, int oy, int y, int x0, int count, std::vector<Span>& spans) const {
+    int r = y - oy - firstRow;
+
+    if (r < 0 || r + 1 >= (int)starts.size())
+        return;
+
+    int shift = ox - x0;
+
+    for (int k {starts[r]}; k < starts[r + 1]; k++) {
+        int first = std::max(0, this->spans[k].first + shift);
+        int last  = std::min(count - 1, this->spans[k].last + shift);
+
+        if (first <= last)
+            spans.push_back(Span { first, last });
+    }
+}
+
+size_t SpanMask::bytes() const {
+    return sizeof(SpanMask) + starts.capacity() * sizeof(int) + spans.capacity() * sizeof(Span);
+}
+
+size_t MaskCache::KeyHash::operator()(const MaskKey& key) const {
+    std::hash<Coord> hash;
+    size_t h = key.kind;
+
+    h = h * 31 + key.across;
+    h = h * 31 + key.up;
+    h = h * 31 + hash(key.a);
+    h = h * 31 + hash(key.b);
+    h = h * 31 + hash(key.c);
+    return h * 31 + hash(key.d);
+}
+
+MaskCache::MaskCache(size_t limit) : limit(limit), held(0), found(0), built(0) {}
+
+// Bounds past this would not leave the column count room in an int
+static constexpr Coord MAX_EXTENT = Coord(1 << 29);
+
+std::shared_ptr<SpanMask> MaskCache::build(const Shape& sh, int ox, int oy, int bottom, int top) {
+    GEOMETRY_TRACE_SCOPE("build mask");
+
+    // A column of slack either side of the bounds covers their rounding
+    BoundingBox b = sh.bounds();
+    int left  = (int)std::floor(b.xmin) - 1;
+    int count = (int)std::ceil(b.xmax) + 2 - left;
+
+    auto mask = std::make_shared<SpanMask>();
+    mask->firstRow = bottom - oy;
+    mask->starts.reserve(top - bottom + 2);
+    mask->starts.push_back(0);
+
+    for (int y {bottom}; y <= top; y++) {
+        size_t first = mask->spans.size();
+        sh.rowSpans(y, left, count, mask->spans);
+
+        for (size_t k {first}; k < mask->spans.size(); k++) {
+            mask->spans[k].first += left - ox;
+            mask->spans[k].last  += left - ox;
+        }
+
+        mask->starts.push_back(mask->spans.size());
+    }
+
+    mask->spans.shrink_to_fit();
+    return mask;
+}
+
+std::shared_ptr<const SpanMask> MaskCache::find(const Shape& sh, int bottom, int top, int& ox, int& oy) {
+    MaskKey key;
+
+    if (!sh.maskKey(key, ox, oy))
+        return nullptr;
+
+    BoundingBox b = sh.bounds();
+    if (!(std::fabs(b.xmin) < MAX_EXTENT && std::fabs(b.xmax) < MAX_EXTENT &&
+          std::fabs(b.ymin) < MAX_EXTENT && std::fabs(b.ymax) < MAX_EXTENT))
+        return nullptr;
+
+    // Only the shape's rows on the canvas, with a row of slack either side
+    // of the bounds for their rounding
+    bottom = std::max(bottom, (int)std::floor(b.ymin) - 1);
+    top    = std::min(top, (int)std::ceil(b.ymax) + 1);
+
+    if (bottom > top)
+        return nullptr;
+
+    auto it = index.find(key);
+    if (it != index.end()) {
+        std::shared_ptr<const SpanMask> mask = it->second->mask;
+        int rows = (int)mask->starts.size() - 1;
+
+        if (mask->firstRow <= bottom - oy && top - oy < mask->firstRow + rows) {
+            entries.splice(entries.begin(), entries, it->second);
+            found++;
+            return mask;
+        }
+
+        // Built for other rows of the canvas, so build it again below
+        held -= mask->bytes();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    // Every row holds at least its start and usually one span
+    if ((size_t)(top - bottom + 3) * (sizeof(int) + sizeof(Span)) > limit)
+        return nullptr;
+
+    std::shared_ptr<const SpanMask> mask = build(sh, ox, oy, bottom, top);
+    built++;
+
+    entries.push_front(Entry { key, mask });
+    index[key] = entries.begin();
+    held += mask->bytes();
+    evict();
+
+    return mask;
+}
+
+void MaskCache::evict() {
+    while (held > limit && !entries.empty()) {
+        held -= entries.back().mask->bytes();
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+void MaskCache::setLimit(size_t limit) {
+    this->limit = limit;
+    evict();
+}
+
+size_t MaskCache::getLimit() const {
+    return limit;
+}
+
+size_t MaskCache::bytes() const {
+    return held;
+}
+
+size_t MaskCache::size() const {
+    return entries.size();
+}
+
+unsigned long MaskCache::hits() const {
+    return found;
+}
+
+unsigned long MaskCache::misses() const {
+    return built;
+}
+
+void MaskCache::clear() {
+    entries.clear();
+    index.clear();
+    held = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef MASKCACHE_H_
+#define MASKCACHE_H_
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "Geometry.h"
+
+// A shape's geometry up to a whole-cell translation: its kind, the exact
+// fractional offsets of its defining coordinates within their cells, and
+// any extents. Two shapes with equal keys cover the same cells once shifted
+// by the difference of their reference cells.
+struct MaskKey {
+	enum Kind { PointMask, SegmentMask, RectangleMask, CircleMask };
+
+	int kind;
+
+	// Whole cells from the first defining corner to the second
+	int across, up;
+
+	// Fractional offsets and other intrinsic values (a radius)
+	Coord a, b, c, d;
+
+	bool operator==(const MaskKey& other) const;
+
+	// Split v into whole cell n and fraction f with n + f exactly v. Return
+	// false if that is not possible or n would not fit in an int.
+	static bool split(Coord v, int& n, Coord& f);
+};
+
+// Covered cells of one shape, row by row, relative to its reference cell
+class SpanMask {
+
+public:
+	// Append to spans the covered cells of canvas row y, columns x0 to
+	// x0 + count - 1, of the shape placed with its reference cell at
+	// (ox, oy), clipped to the columns and numbered from x0 as in rowSpans.
+	// Rows the mask was not built for are empty.
+	void rowSpans(int ox, int oy, int y, int x0, int count, std::vector<Span>& spans) const;
+
+	// Memory held by the mask
+	size_t bytes() const;
+
+private:
+	friend class MaskCache;
+
+	// Spans of row firstRow + r are spans[starts[r]] .. spans[starts[r + 1] - 1]
+	int firstRow;
+	std::vector<int> starts;
+	std::vector<Span> spans;
+};
+
+// Span masks of shapes keyed on their geometry, so a shape that has only
+// moved by whole cells, or another of the same size and cell offset, reuses
+// a mask instead of being rasterised again. A mask gives exactly the spans
+// rowSpans would. Masks are evicted least recently used first once they
+// take more than the memory limit.
+class MaskCache {
+
+public:
+	explicit MaskCache(size_t limit = DEFAULT_LIMIT);
+
+	// Mask of sh with its reference cell in (ox, oy), covering at least
+	// the shape's rows from bottom to top, built on a miss. Only those rows
+	// are rasterised, so a tall shape costs its rows on the canvas; a mask
+	// built for other rows is built again. Null if sh has no mask key, its
+	// bounds are too large to number in an int, it has no rows in the range
+	// or its mask alone would pass the limit; such shapes count as neither
+	// hits nor misses. Masks stay valid after they leave the cache.
+	std::shared_ptr<const SpanMask> find(const Shape& sh, int bottom, int top, int& ox, int& oy);
+
+	// Memory limit in bytes; lowering it evicts straight away
+	void setLimit(size_t limit);
+	size_t getLimit() const;
+
+	// Memory held and masks cached
+	size_t bytes() const;
+	size_t size() const;
+
+	unsigned long hits() const;
+	unsigned long misses() const;
+
+	void clear();
+
+	static constexpr size_t DEFAULT_LIMIT = 4 << 20;
+
+private:
+	struct KeyHash {
+		size_t operator()(const MaskKey& key) const;
+	};
+
+	struct Entry {
+		MaskKey key;
+		std::shared_ptr<const SpanMask> mask;
+	};
+
+	// Most recently used first
+	std::list<Entry> entries;
+	std::unordered_map<MaskKey, std::list<Entry>::iterator, KeyHash> index;
+
+	size_t limit, held;
+	unsigned long found, built;
+
+	// Rasterise rows bottom to top of sh, whose reference cell is (ox, oy),
+	// into a new mask
+	static std::shared_ptr<SpanMask> build(const Shape& sh, int ox, int oy, int bottom, int top);
+
+	void evict();
+};
+
+#endif /* MASKCACHE_H_ */
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Profiling.h"
+
+
+// ============ SceneStats struct ================
+
+unsigned long long SceneStats::operator[](Counter c) const {
+    return counters[(int)c];
+}
+
+unsigned long long SceneStats::calls(Timer t) const {
+    unsigned long long total {0};
+    
+    for (int i {0}; i < BUCKETS; i++)
+        total += histograms[(int)t][i];
+    
+    return total;
+}
+
+double SceneStats::quantile(Timer t, double p) const {
+    unsigned long long total = calls(t), seen {0};
+    
+    if (total == 0)
+        return 0;
+    
+    for (int i {0}; i < BUCKETS; i++) {
+        seen += histograms[(int)t][i];
+        if (seen >= p * total)
+            return (double)(2ULL << i);
+    }
+    
+    return (double)(2ULL << (BUCKETS - 1));
+}
+
+
+// ============ Stats functions ================
+
+namespace {
+
+// One thread's counts. Only the owning thread writes, so a relaxed load and
+// store is enough and avoids a locked read-modify-write on the hot path.
+struct ThreadStats {
+    std::atomic<unsigned long long> counters[(int)Counter::COUNT];
+    std::atomic<unsigned long long> histograms[(int)Timer::COUNT][SceneStats::BUCKETS];
+
+    ThreadStats() {
+        clear();
+    }
+
+    void clear() {
+        for (auto& c: counters)
+            c.store(0, std::memory_order_relaxed);
+        for (auto& h: histograms)
+            for (auto& b: h)
+                b.store(0, std::memory_order_relaxed);
+    }
+};
+
+inline void bump(std::atomic<unsigned long long>& value, unsigned long long n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Every thread's block, kept after the thread ends so its counts survive
+std::mutex registryLock;
+std::vector<std::shared_ptr<ThreadStats>> registry;
+
+ThreadStats& local() {
+    thread_local std::shared_ptr<ThreadStats> mine;
+    
+    if (!mine) {
+        mine = std::make_shared<ThreadStats>();
+        
+        std::lock_guard<std::mutex> guard(registryLock);
+        registry.push_back(mine);
+    }
+    
+    return *mine;
+}
+
+}
+
+void Stats::add(Counter c, unsigned long long n) {
+    bump(local().counters[(int)c], n);
+}
+
+void Stats::record(Timer t, unsigned long long nanoseconds) {
+    int bucket {0};
+    
+    while (nanoseconds > 1 && bucket < SceneStats::BUCKETS - 1) {
+        nanoseconds >>= 1;
+        bucket++;
+    }
+    
+    bump(local().histograms[(int)t][bucket], 1);
+}
+
+SceneStats Stats::collect() {
+    SceneStats total = SceneStats();
+    
+    std::lock_guard<std::mutex> guard(registryLock);
+    
+    for (const auto& block: registry) {
+        for (int c {0}; c < (int)Counter::COUNT; c++)
+            total.counters[c] += block->counters[c].load(std::memory_order_relaxed);
+        
+        for (int t {0}; t < (int)Timer::COUNT; t++)
+            for (int i {0}; i < SceneStats::BUCKETS; i++)
+                total.histograms[t][i] += block->histograms[t][i].load(std::memory_order_relaxed);
+    }
+    
+    return total;
+}
+
+void Stats::reset() {
+    std::lock_guard<std::mutex> guard(registryLock);
+    
+    for (const auto& block: registry)
+        block->clear();
+}
+
+
+// ============ Trace functions ================
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    const char* argName;
+    long arg;
+    long long start, duration;  // nanoseconds since traceEpoch
+};
+
+// One thread's events. Only the owning thread appends.
+struct TraceBuffer {
+    int thread;
+    std::vector<TraceEvent> events;
+};
+
+const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+std::mutex traceLock;
+std::vector<std::shared_ptr<TraceBuffer>> traceBuffers;
+
+TraceBuffer& localTrace() {
+    thread_local std::shared_ptr<TraceBuffer> mine;
+    
+    if (!mine) {
+        mine = std::make_shared<TraceBuffer>();
+        mine->events.reserve(1 << 16);
+        
+        std::lock_guard<std::mutex> guard(traceLock);
+        mine->thread = traceBuffers.size() + 1;
+        traceBuffers.push_back(mine);
+    }
+    
+    return *mine;
+}
+
+long long sinceEpoch(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - traceEpoch).count();
+}
+
+}
+
+void Trace::record(const char* name, std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end, const char* argName, long arg) {
+    long long from = sinceEpoch(start);
+    
+    localTrace().events.push_back(TraceEvent { name, argName, arg, from, sinceEpoch(end) - from });
+}
+
+bool Trace::write(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    
+    if (file == nullptr)
+        return false;
+    
+    std::lock_guard<std::mutex> guard(traceLock);
+    
+    // Complete ("X") events with microsecond timestamps
+    fputs("{\"traceEvents\":[\n", file);
+    
+    bool first {true};
+    for (const auto& buffer: traceBuffers) {
+        for (const TraceEvent& e: buffer->events) {
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    first ? "" : ",\n", e.name, buffer->thread, e.start / 1000.0, e.duration / 1000.0);
+            if (e.argName != nullptr && e.arg >= 0)
+                fprintf(file, ",\"args\":{\"%s\":%ld}", e.argName, e.arg);
+            fputc('}', file);
+            first = false;
+        }
+    }
+    
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", file);
+    
+    return fclose(file) == 0;
+}
+
+void Trace::clear() {
+    std::lock_guard<std::mutex> guard(traceLock);
+    
+    for (const auto& buffer: traceBuffers)
+        buffer->events.clear();
+}
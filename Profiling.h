@@ -0,0 +1,146 @@
+#ifndef PROFILING_H_
+#define PROFILING_H_
+
+#include <chrono>
+#include <string>
+
+// Hot-path counters and latency histograms for rendering, queries and
+// mutations. They are opt-in: build with -DGEOMETRY_STATS (make STATS=1) to
+// compile them in. Otherwise the GEOMETRY_COUNT and GEOMETRY_TIME macros
+// expand to nothing and Scene::stats() reports zeros.
+//
+// Each thread counts into its own block, so updates are uncontended plain
+// relaxed-atomic stores. Reading the stats adds up every thread's block,
+// including those of threads that have finished.
+
+enum class Counter {
+    PointContains,      // contains() calls per shape type
+    LineContains,
+    RectangleContains,
+    CircleContains,
+    PolygonContains,
+    CellsTested,        // CheckEmpty calls, one per cell drawn by operator<<
+    DepthCutoffs,       // CheckEmpty calls ended early by the draw depth
+    RowsRasterised,     // rows produced by RowRasteriser
+    SpansProduced,      // merged spans in those rows
+    RangeQueries,
+    NearestQueries,
+    OverlapQueries,
+    IndexRebuilds,
+    IndexRefits,        // changed shapes refitted in place instead
+    ShapeChanges,       // translate, rotate, scale and setDepth calls
+    ObjectsAdded,
+    COUNT
+};
+
+enum class Timer {
+    Render,             // operator<<
+    Coverage,           // renderCoverage
+    RangeQuery,
+    NearestQuery,
+    OverlapQuery,
+    CoveredArea,
+    COUNT
+};
+
+// Totals across all threads at the time Scene::stats() was called
+struct SceneStats {
+    // Bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds
+    static constexpr int BUCKETS = 40;
+
+    unsigned long long counters[(int)Counter::COUNT];
+    unsigned long long histograms[(int)Timer::COUNT][BUCKETS];
+
+    unsigned long long operator[](Counter c) const;
+
+    // Number of calls timed by t
+    unsigned long long calls(Timer t) const;
+
+    // Upper bound in nanoseconds of the bucket holding the p-th quantile
+    // (0 < p <= 1) of t's latencies, or 0 if nothing was timed
+    double quantile(Timer t, double p) const;
+};
+
+namespace Stats {
+    void add(Counter c, unsigned long long n);
+    void record(Timer t, unsigned long long nanoseconds);
+
+    // Sum of every thread's counts
+    SceneStats collect();
+
+    // Zero every thread's counts. Updates racing with the reset may survive it.
+    void reset();
+
+    // Records the time between its construction and destruction
+    class ScopedTimer {
+    public:
+        ScopedTimer(Timer t) : timer(t), start(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer() {
+            record(timer, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+        Timer timer;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+// Timeline tracing of the render pipeline, written as Chrome trace JSON
+// that chrome://tracing or the Perfetto UI can open. Build with
+// -DGEOMETRY_TRACE (make TRACE=1) to compile in the GEOMETRY_TRACE_SCOPE
+// markers. Each thread appends to its own buffer without locking; only the
+// first event on a thread takes a lock, to register the buffer.
+namespace Trace {
+    // Append a complete event for [start, end) on the calling thread. name
+    // must be a string literal. arg, when not negative, is shown as argName.
+    void record(const char* name, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end, const char* argName, long arg);
+
+    // Write every thread's events to path. Call while no traced work is
+    // running. Returns false if the file cannot be written.
+    bool write(const std::string& path);
+
+    // Drop every recorded event
+    void clear();
+
+    // Records one event covering its own lifetime
+    class Scope {
+    public:
+        Scope(const char* name, const char* argName = nullptr, long arg = -1)
+            : name(name), argName(argName), arg(arg), start(std::chrono::steady_clock::now()) {}
+        ~Scope() {
+            record(name, start, std::chrono::steady_clock::now(), argName, arg);
+        }
+
+    private:
+        const char* name;
+        const char* argName;
+        long arg;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+#define GEOMETRY_CONCAT_(a, b) a##b
+#define GEOMETRY_CONCAT(a, b) GEOMETRY_CONCAT_(a, b)
+
+#ifdef GEOMETRY_STATS
+#define GEOMETRY_COUNT(counter) Stats::add(Counter::counter, 1)
+#define GEOMETRY_COUNT_N(counter, n) Stats::add(Counter::counter, (n))
+#define GEOMETRY_TIME(timer) Stats::ScopedTimer GEOMETRY_CONCAT(statsTimer_, __LINE__)(Timer::timer)
+#else
+#define GEOMETRY_COUNT(counter) ((void)0)
+#define GEOMETRY_COUNT_N(counter, n) ((void)0)
+#define GEOMETRY_TIME(timer) ((void)0)
+#endif
+
+#ifdef GEOMETRY_TRACE
+#define GEOMETRY_TRACE_SCOPE(name) Trace::Scope GEOMETRY_CONCAT(traceScope_, __LINE__)(name)
+#define GEOMETRY_TRACE_SCOPE_ARG(name, argName, arg) \
+    Trace::Scope GEOMETRY_CONCAT(traceScope_, __LINE__)(name, argName, (arg))
+#else
+#define GEOMETRY_TRACE_SCOPE(name) ((void)0)
+#define GEOMETRY_TRACE_SCOPE_ARG(name, argName, arg) ((void)0)
+#endif
+
+#endif /* PROFILING_H_ */
@@ -0,0 +1,164 @@
+#include <stdexcept>
+
+#include "ShapeFactory.h"
+
+const char* describe(ShapeError error) {
+    switch (error) {
+    case ShapeError::None:           return "No error";
+    case ShapeError::NegativeDepth:  return "Negative depth not allowed!";
+    case ShapeError::DepthMismatch:  return "Points depth mismatch";
+    case ShapeError::NotAxisAligned: return "Line is not axis-aligned";
+    case ShapeError::PointsCoincide: return "Points coincide";
+    case ShapeError::ZeroExtent:     return "Lines coincide";
+    case ShapeError::BadRadius:      return "Radius must be positive";
+    case ShapeError::BadScale:       return "Negative scale factor";
+    default:                         return "Unknown kind of shape";
+    }
+}
+
+// The checks below repeat the constructors' own, in the same order
+
+ShapeResult<Point> makePoint(Coord x, Coord y, int d) {
+    if (d < 0)
+        return { nullptr, ShapeError::NegativeDepth };
+    
+    return { std::make_shared<Point>(x, y, d), ShapeError::None };
+}
+
+ShapeResult<LineSegment> makeLineSegment(const Point& p, const Point& q) {
+    if (p.getDepth() != q.getDepth())
+        return { nullptr, ShapeError::DepthMismatch };
+    if (p.getX() != q.getX() && p.getY() != q.getY())
+        return { nullptr, ShapeError::NotAxisAligned };
+    if (p.getX() == q.getX() && p.getY() == q.getY())
+        return { nullptr, ShapeError::PointsCoincide };
+    
+    return { std::make_shared<LineSegment>(p, q), ShapeError::None };
+}
+
+ShapeResult<Rectangle> makeRectangle(const Point& p, const Point& q) {
+    if (p.getDepth() != q.getDepth())
+        return { nullptr, ShapeError::DepthMismatch };
+    if (p.getX() == q.getX() || p.getY() == q.getY())
+        return { nullptr, ShapeError::ZeroExtent };
+    
+    return { std::make_shared<Rectangle>(p, q), ShapeError::None };
+}
+
+ShapeResult<Circle> makeCircle(const Point& c, Coord r) {
+    if (r <= 0)
+        return { nullptr, ShapeError::BadRadius };
+    
+    return { std::make_shared<Circle>(c, r), ShapeError::None };
+}
+
+ShapeError tryScale(Shape& sh, Coord f) {
+    // Every scale() refuses exactly these factors
+    if (f <= 0)
+        return ShapeError::BadScale;
+    
+    sh.scale(f);
+    return ShapeError::None;
+}
+
+// ============== ShapeBatch class ================
+
+void ShapeBatch::add(ShapeKind k, Coord x1, Coord y1, Coord x2, Coord y2, int d1, int d2) {
+    kind.push_back(k);
+    this->x1.push_back(x1);
+    this->y1.push_back(y1);
+    this->x2.push_back(x2);
+    this->y2.push_back(y2);
+    this->d1.push_back(d1);
+    this->d2.push_back(d2);
+}
+
+size_t ShapeBatch::size() const {
+    return kind.size();
+}
+
+void ShapeBatch::clear() {
+    kind.clear();
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+    d1.clear();
+    d2.clear();
+}
+
+// v if cond and e otherwise, by masking rather than branching
+static inline unsigned char pick(bool cond, ShapeError v, unsigned char e) {
+    unsigned char mask = -(unsigned char)cond;
+    
+    return (e & ~mask) | ((unsigned char)v & mask);
+}
+
+void validateShapes(const ShapeBatch& batch, std::vector<ShapeError>& errors) {
+    size_t n = batch.size();
+    
+    if (batch.x1.size() != n || batch.y1.size() != n || batch.x2.size() != n || batch.y2.size() != n ||
+        batch.d1.size() != n || batch.d2.size() != n)
+        throw std::invalid_argument("Batch arrays differ in length");
+    
+    errors.resize(n);
+    
+    const ShapeKind* kind = batch.kind.data();
+    const Coord *x1 = batch.x1.data(), *y1 = batch.y1.data(), *x2 = batch.x2.data(), *y2 = batch.y2.data();
+    const int *d1 = batch.d1.data(), *d2 = batch.d2.data();
+    unsigned char* out = reinterpret_cast<unsigned char*>(errors.data());
+    
+    // Every test is worked out for every entry and the answer picked by
+    // kind, lowest priority first, so the loop has no branches
+    for (size_t i = 0; i < n; i++) {
+        int k = (int)kind[i];
+        bool segment = k == (int)ShapeKind::LineSegment, rectangle = k == (int)ShapeKind::Rectangle;
+        bool circle = k == (int)ShapeKind::Circle, two = segment | rectangle;
+        
+        // Written as the constructors' tests, so that NaNs fall the same way
+        bool sameX = x1[i] == x2[i], sameY = y1[i] == y2[i];
+        bool apart = (x1[i] != x2[i]) & (y1[i] != y2[i]);
+        bool radius = x2[i] <= 0;
+        
+        unsigned char e = (unsigned char)ShapeError::None;
+        e = pick(segment & apart, ShapeError::NotAxisAligned, e);
+        e = pick(segment & sameX & sameY, ShapeError::PointsCoincide, e);
+        e = pick(rectangle & (sameX | sameY), ShapeError::ZeroExtent, e);
+        e = pick(circle & radius, ShapeError::BadRadius, e);
+        e = pick(two & (d1[i] != d2[i]), ShapeError::DepthMismatch, e);
+        e = pick((d1[i] < 0) | (two & (d2[i] < 0)), ShapeError::NegativeDepth, e);
+        e = pick(k > (int)ShapeKind::Circle, ShapeError::UnknownKind, e);
+        
+        out[i] = e;
+    }
+}
+
+void buildShapes(const ShapeBatch& batch, std::vector<std::shared_ptr<Shape>>& shapes,
+                 std::vector<ShapeError>& errors) {
+    validateShapes(batch, errors);
+    
+    shapes.assign(batch.size(), nullptr);
+    
+    // Only valid candidates reach the constructors, so none of them throws
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (errors[i] != ShapeError::None)
+            continue;
+        
+        Point p(batch.x1[i], batch.y1[i], batch.d1[i]);
+        
+        switch (batch.kind[i]) {
+        case ShapeKind::Point:
+            shapes[i] = std::make_shared<Point>(p);
+            break;
+        case ShapeKind::LineSegment:
+            shapes[i] = std::make_shared<LineSegment>(p, Point(batch.x2[i], batch.y2[i], batch.d2[i]));
+            break;
+        case ShapeKind::Rectangle:
+            shapes[i] = std::make_shared<Rectangle>(p, Point(batch.x2[i], batch.y2[i], batch.d2[i]));
+            break;
+        case ShapeKind::Circle:
+            shapes[i] = std::make_shared<Circle>(p, batch.x2[i]);
+            break;
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef SHAPEFACTORY_H_
+#define SHAPEFACTORY_H_
+
+#include <memory>
+#include <vector>
+#include "Geometry.h"
+
+// Why a shape could not be made or changed, one value for each case in
+// which the constructors and scale() throw a std::invalid_argument
+// exception. Sized for the batch validator's output array.
+enum class ShapeError : unsigned char {
+	None,
+	NegativeDepth,    // a point's depth is negative
+	DepthMismatch,    // the two points have different depths
+	NotAxisAligned,   // a segment's points differ in both x and y
+	PointsCoincide,   // a segment's points are the same
+	ZeroExtent,       // a rectangle's points share an x or a y
+	BadRadius,        // a circle's radius is not positive
+	BadScale,         // a scale factor is not positive
+	UnknownKind       // a batch entry names no kind of shape
+};
+
+// Short description of error, as an exception message would give it
+const char* describe(ShapeError error);
+
+// A new shape, or the reason none was made. Tests true when shape is set.
+template <class T>
+struct ShapeResult {
+	std::shared_ptr<T> shape;
+	ShapeError error;
+
+	explicit operator bool() const { return error == ShapeError::None; }
+};
+
+// Counterparts of the Point, LineSegment, Rectangle and Circle constructors
+// that report bad arguments through the result instead of throwing, for
+// input where invalid records are routine. They accept and reject exactly
+// what the constructors do.
+ShapeResult<Point> makePoint(Coord x, Coord y, int d = 0);
+ShapeResult<LineSegment> makeLineSegment(const Point& p, const Point& q);
+ShapeResult<Rectangle> makeRectangle(const Point& p, const Point& q);
+ShapeResult<Circle> makeCircle(const Point& c, Coord r);
+
+// Scale sh by f, or leave it unchanged and return BadScale where sh.scale(f)
+// would throw
+ShapeError tryScale(Shape& sh, Coord f);
+
+enum class ShapeKind : unsigned char { Point, LineSegment, Rectangle, Circle };
+
+// Candidate shapes as parallel arrays, entry i of each describing shape i.
+// Points use (x1, y1) at depth d1. Segments and rectangles run between
+// (x1, y1) at depth d1 and (x2, y2) at depth d2. Circles are centred on
+// (x1, y1) at depth d1 with radius x2.
+struct ShapeBatch {
+	std::vector<ShapeKind> kind;
+	std::vector<Coord> x1, y1, x2, y2;
+	std::vector<int> d1, d2;
+
+	// Append a candidate; unused fields are 0
+	void add(ShapeKind k, Coord x1, Coord y1, Coord x2 = 0, Coord y2 = 0, int d1 = 0, int d2 = 0);
+
+	size_t size() const;
+	void clear();
+};
+
+// Store in errors[i] what building candidate i would fail with, or None.
+// One branch-free pass over the arrays, which the compiler can vectorise.
+// If the arrays differ in length, throw a std::invalid_argument exception.
+void validateShapes(const ShapeBatch& batch, std::vector<ShapeError>& errors);
+
+// Validate the batch, then build every valid candidate. shapes[i] is the
+// shape made from candidate i, or null where errors[i] says why not.
+void buildShapes(const ShapeBatch& batch, std::vector<std::shared_ptr<Shape>>& shapes,
+                 std::vector<ShapeError>& errors);
+
+#endif /* SHAPEFACTORY_H_ */
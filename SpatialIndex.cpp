@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+#include <queue>
+
+#include "SpatialIndex.h"
+
+
+SpatialIndex::SpatialIndex() : slots(2, -1) {}
+
+size_t SpatialIndex::size() const {
+    return entries.size();
+}
+
+void SpatialIndex::build(const std::vector<Shape*>& shapes) {
+    entries.clear();
+    nodes.clear();
+    parents.clear();
+    
+    for (Shape* sh: shapes)
+        entries.push_back(Entry { sh->bounds(), sh });
+    
+    leaves.resize(entries.size());
+    
+    if (!entries.empty()) {
+        nodes.reserve(4 * entries.size() / LEAF_SIZE + 1);
+        nodes.resize(1);
+        parents.push_back(-1);
+        buildNode(0, 0, entries.size());
+    }
+    
+    // At most half full, so probes stay short
+    size_t size {2};
+    while (size < 2 * entries.size())
+        size *= 2;
+    
+    slots.assign(size, -1);
+    for (size_t i {0}; i < entries.size(); i++) {
+        size_t k = slotOf(entries[i].shape);
+        while (slots[k] >= 0)
+            k = (k + 1) & (size - 1);
+        slots[k] = i;
+    }
+}
+
+size_t SpatialIndex::slotOf(const Shape* sh) const {
+    uint64_t h = (uint64_t)(uintptr_t)sh * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & (slots.size() - 1);
+}
+
+void SpatialIndex::refit(const std::vector<const Shape*>& changed) {
+    // A shape added more than once has an entry for each time
+    for (const Shape* sh: changed) {
+        for (size_t k {slotOf(sh)}; slots[k] >= 0; k = (k + 1) & (slots.size() - 1)) {
+            int i = slots[k];
+            if (entries[i].shape != sh)
+                continue;
+            
+            entries[i].box = sh->bounds();
+            
+            // Nodes above one whose box held still are unaffected
+            for (int n {leaves[i]}; n >= 0 && fitNode(n); n = parents[n]) {}
+        }
+    }
+}
+
+bool SpatialIndex::fitNode(int index) {
+    Node& node = nodes[index];
+    BoundingBox box;
+    
+    if (node.count > 0) {
+        box = entries[node.first].box;
+        for (int i {node.first + 1}; i < node.first + node.count; i++) {
+            box.xmin = std::min(box.xmin, entries[i].box.xmin);
+            box.ymin = std::min(box.ymin, entries[i].box.ymin);
+            box.xmax = std::max(box.xmax, entries[i].box.xmax);
+            box.ymax = std::max(box.ymax, entries[i].box.ymax);
+        }
+    }
+    else {
+        const BoundingBox& l = nodes[node.child].box;
+        const BoundingBox& r = nodes[node.child + 1].box;
+        box = BoundingBox { std::min(l.xmin, r.xmin), std::min(l.ymin, r.ymin),
+                            std::max(l.xmax, r.xmax), std::max(l.ymax, r.ymax) };
+    }
+    
+    if (box.xmin == node.box.xmin && box.ymin == node.box.ymin &&
+        box.xmax == node.box.xmax && box.ymax == node.box.ymax)
+        return false;
+    
+    node.box = box;
+    return true;
+}
+
+void SpatialIndex::buildNode(int index, int first, int count) {
+    BoundingBox box = entries[first].box;
+    for (int i {first + 1}; i < first + count; i++) {
+        box.xmin = std::min(box.xmin, entries[i].box.xmin);
+        box.ymin = std::min(box.ymin, entries[i].box.ymin);
+        box.xmax = std::max(box.xmax, entries[i].box.xmax);
+        box.ymax = std::max(box.ymax, entries[i].box.ymax);
+    }
+    
+    nodes[index].box   = box;
+    nodes[index].first = first;
+    
+    if (count <= LEAF_SIZE) {
+        nodes[index].count = count;
+        nodes[index].child = -1;
+        
+        for (int i {first}; i < first + count; i++)
+            leaves[i] = index;
+        return;
+    }
+    
+    // Split at the median centre along the longer side
+    bool alongX = (box.xmax - box.xmin) >= (box.ymax - box.ymin);
+    int half = count / 2;
+    
+    std::nth_element(entries.begin() + first, entries.begin() + first + half, entries.begin() + first + count,
+                     [alongX](const Entry& l, const Entry& r) {
+                         return alongX ? l.box.xmin + l.box.xmax < r.box.xmin + r.box.xmax
+                                       : l.box.ymin + l.box.ymax < r.box.ymin + r.box.ymax;
+                     });
+    
+    // Both children are allocated together so a node only needs one link
+    int child = nodes.size();
+    nodes.resize(child + 2);
+    parents.resize(child + 2, index);
+    
+    nodes[index].count = 0;
+    nodes[index].child = child;
+    
+    buildNode(child, first, half);
+    buildNode(child + 1, first + half, count - half);
+}
+
+void SpatialIndex::nearest(Coord x, Coord y, size_t k, std::vector<Neighbour>& results) const {
+    results.clear();
+    
+    if (nodes.empty() || k == 0)
+        return;
+    
+    // Node n is queued as n, entry i as -(i + 1)
+    typedef std::pair<Coord, int> Item;
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item>> queue;
+    
+    auto boxDistance = [x, y](const BoundingBox& box) {
+        Coord dx = std::max(std::max(box.xmin - x, x - box.xmax), Coord(0.0));
+        Coord dy = std::max(std::max(box.ymin - y, y - box.ymax), Coord(0.0));
+        return std::sqrt(dx * dx + dy * dy);
+    };
+    
+    queue.push(Item(boxDistance(nodes[0].box), 0));
+    
+    while (!queue.empty() && results.size() < k) {
+        Item item = queue.top();
+        queue.pop();
+        
+        if (item.second < 0) {
+            results.push_back(Neighbour { entries[-item.second - 1].shape, item.first });
+            continue;
+        }
+        
+        const Node& node = nodes[item.second];
+        
+        if (node.count > 0) {
+            for (int i {node.first}; i < node.first + node.count; i++)
+                queue.push(Item(entries[i].shape->distanceTo(x, y), -(i + 1)));
+        }
+        else {
+            queue.push(Item(boxDistance(nodes[node.child].box), node.child));
+            queue.push(Item(boxDistance(nodes[node.child + 1].box), node.child + 1));
+        }
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef SPATIALINDEX_H_
+#define SPATIALINDEX_H_
+
+#include <vector>
+#include "Geometry.h"
+
+// Bounding volume hierarchy over shape bounding boxes. It is bulk built in
+// O(n log n) by splitting on the median of the longer axis. Shapes that
+// move or change are refitted in place, which keeps the tree's structure:
+// rebuild it when shapes are added or have wandered far.
+class SpatialIndex {
+
+public:
+	SpatialIndex();
+
+	// Replace the contents of the index with shapes
+	void build(const std::vector<Shape*>& shapes);
+
+	// Update the boxes of the changed shapes, and of the nodes above them,
+	// in O(depth) each. Queries stay exact but slow down as refitted boxes
+	// spread. Shapes not in the index are ignored.
+	void refit(const std::vector<const Shape*>& changed);
+
+	// Number of shapes indexed
+	size_t size() const;
+
+	// Call visit(shape) for every indexed shape whose bounding box meets box
+	template<typename Visitor>
+	void query(const BoundingBox& box, Visitor visit) const;
+
+	// Store in results the k shapes nearest to (x, y), closest first.
+	// Nodes and shapes share one queue ordered by distance, so a shape
+	// leaves the queue only once nothing left can be closer.
+	void nearest(Coord x, Coord y, size_t k, std::vector<Neighbour>& results) const;
+
+	// Shapes stop being split below this count per leaf
+	static constexpr int LEAF_SIZE = 8;
+
+private:
+    struct Entry {
+        BoundingBox box;
+        Shape* shape;
+    };
+
+    // Leaves own entries [first, first + count); inner nodes have count 0
+    // and their children at child and child + 1
+    struct Node {
+        BoundingBox box;
+        int first, count, child;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<Node> nodes;
+
+    // Parent of each node (-1 for the root) and leaf of each entry
+    std::vector<int> parents, leaves;
+
+    // Open-addressed table of entries keyed on their shapes, -1 where empty
+    std::vector<int> slots;
+
+    // Where the probe for sh starts in slots
+    size_t slotOf(const Shape* sh) const;
+
+    // Fill node index with entries [first, first + count) and split it
+    void buildNode(int index, int first, int count);
+
+    // Recompute the box of node index from its entries or children, and
+    // return whether it changed
+    bool fitNode(int index);
+
+    static bool overlap(const BoundingBox& a, const BoundingBox& b);
+};
+
+
+template<typename Visitor>
+void SpatialIndex::query(const BoundingBox& box, Visitor visit) const {
+    if (nodes.empty())
+        return;
+
+    // Median splits keep the tree depth near log2(n / LEAF_SIZE)
+    int stack[64];
+    int top {0};
+    stack[top++] = 0;
+
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+
+        if (!overlap(node.box, box))
+            continue;
+
+        if (node.count > 0) {
+            for (int i {node.first}; i < node.first + node.count; i++)
+                if (overlap(entries[i].box, box))
+                    visit(entries[i].shape);
+        }
+        else {
+            stack[top++] = node.child;
+            stack[top++] = node.child + 1;
+        }
+    }
+}
+
+inline bool SpatialIndex::overlap(const BoundingBox& a, const BoundingBox& b) {
+    return a.xmin <= b.xmax && b.xmin <= a.xmax && a.ymin <= b.ymax && b.ymin <= a.ymax;
+}
+
+#endif /* SPATIALINDEX_H_ */
@@ -0,0 +1,194 @@
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Viewport.h"
+
+// Division rounding towards minus infinity, for tile indices left of and
+// below the origin
+static int floorDiv(int a, int b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+bool Viewport::TileKey::operator==(const TileKey& other) const {
+    return zoom == other.zoom && tx == other.tx && ty == other.ty;
+}
+
+size_t Viewport::TileKeyHash::operator()(const TileKey& key) const {
+    size_t h = std::hash<int>()(key.zoom);
+    h = h * 31 + std::hash<int>()(key.tx);
+    return h * 31 + std::hash<int>()(key.ty);
+}
+
+Viewport::Viewport(int width, int height, int samples, size_t capacity)
+    : width(width), height(height), samples(samples), capacity(capacity), level(0),
+      x((width - 1) / Coord(2)), y((height - 1) / Coord(2)), rasterised(0), reused(0) {
+    if (width < 0 || height < 0)
+        throw std::invalid_argument("Negative canvas size");
+    if (samples < 1 || samples > 8)
+        throw std::invalid_argument("Samples per axis must be between 1 and 8");
+    if (capacity == 0)
+        throw std::invalid_argument("Tile cache capacity must be positive");
+}
+
+void Viewport::pan(Coord dx, Coord dy) {
+    x += dx;
+    y += dy;
+}
+
+void Viewport::zoom(int steps) {
+    if (level + steps < MIN_ZOOM || level + steps > MAX_ZOOM)
+        throw std::invalid_argument("Zoom out of range");
+
+    level += steps;
+}
+
+int Viewport::firstColumn() const {
+    return (int)std::lround(x / getCellSize() - (width - 1) / 2.0);
+}
+
+int Viewport::topRow() const {
+    return (int)std::lround(y / getCellSize() + (height - 1) / 2.0);
+}
+
+void Viewport::invalidate(const std::vector<BoundingBox>& changed) {
+    if (changed.size() > CLEAR_LIMIT) {
+        tiles.clear();
+        cache.clear();
+        return;
+    }
+
+    for (auto it = tiles.begin(); it != tiles.end();) {
+        Coord cell = std::ldexp(Coord(1), -it->key.zoom);
+
+        // Tile extent, and shape bounds padded for point and line footprints
+        Coord west  = (it->key.tx * TILE - Coord(0.5)) * cell - Coord(0.5);
+        Coord east  = (it->key.tx * TILE + TILE - Coord(0.5)) * cell + Coord(0.5);
+        Coord south = (it->key.ty * TILE - Coord(0.5)) * cell - Coord(0.5);
+        Coord north = (it->key.ty * TILE + TILE - Coord(0.5)) * cell + Coord(0.5);
+
+        bool reached = std::any_of(changed.begin(), changed.end(), [&](const BoundingBox& box) {
+            return box.xmax >= west && box.xmin <= east && box.ymax >= south && box.ymin <= north;
+        });
+
+        if (reached) {
+            cache.erase(it->key);
+            it = tiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Viewport::render(const Scene& s, std::vector<float>& coverage) {
+    GEOMETRY_TRACE_SCOPE("viewport render");
+
+    std::vector<BoundingBox> changed;
+    changes.update(s, changed);
+
+    if (!changed.empty())
+        invalidate(changed);
+
+    coverage.assign((size_t)width * height, 0);
+    if (width == 0 || height == 0)
+        return;
+
+    Coord cell = getCellSize();
+    int left = firstColumn(), top = topRow();
+
+    // Tiles under the view, and those of them not cached
+    int tx0 = floorDiv(left, TILE), tx1 = floorDiv(left + width - 1, TILE);
+    int ty0 = floorDiv(top - height + 1, TILE), ty1 = floorDiv(top, TILE);
+    int across = tx1 - tx0 + 1;
+
+    std::vector<int> missing;
+    for (int ty {ty0}; ty <= ty1; ty++)
+        for (int tx {tx0}; tx <= tx1; tx++)
+            if (cache.find(TileKey { level, tx, ty }) == cache.end())
+                missing.push_back((ty - ty0) * across + (tx - tx0));
+
+    // Samples lie within half a cell of their cell's centre, and points and
+    // segments reach half a unit past their bounds
+    Coord reach = Coord(0.5) + cell / 2;
+    std::vector<Shape*> found;
+    std::vector<const Shape*> part;
+
+    for (int m: missing) {
+        int tx = tx0 + m % across, ty = ty0 + m / across;
+
+        // Ask the scene's index for the drawn shapes that may reach the tile
+        s.queryRange(tx * TILE * cell - reach, ty * TILE * cell - reach,
+                     (tx * TILE + TILE - 1) * cell + reach, (ty * TILE + TILE - 1) * cell + reach, -1, found);
+
+        part.clear();
+        for (Shape* sh: found)
+            if (changes.isDrawn(sh))
+                part.push_back(sh);
+
+        tiles.push_front(Tile { TileKey { level, tx, ty }, std::vector<float>() });
+        rasteriseCoverage(part, samples, tx * TILE * cell, (ty * TILE + TILE - 1) * cell, cell,
+                          TILE, TILE, tiles.front().cells);
+        cache[tiles.front().key] = tiles.begin();
+        rasterised++;
+    }
+
+    reused += (ty1 - ty0 + 1) * across - missing.size();
+
+    // Copy the part of each tile under the view, marking it recently used
+    for (int ty {ty0}; ty <= ty1; ty++) {
+        for (int tx {tx0}; tx <= tx1; tx++) {
+            auto it = cache.at(TileKey { level, tx, ty });
+            tiles.splice(tiles.begin(), tiles, it);
+
+            // Grid columns and rows the tile and the view share
+            int i0 = std::max(left, tx * TILE), i1 = std::min(left + width, tx * TILE + TILE);
+            int j0 = std::max(top - height + 1, ty * TILE), j1 = std::min(top + 1, ty * TILE + TILE);
+
+            for (int j {j0}; j < j1; j++) {
+                const float* from = &it->cells[(size_t)(ty * TILE + TILE - 1 - j) * TILE + (i0 - tx * TILE)];
+                std::copy(from, from + (i1 - i0), &coverage[(size_t)(top - j) * width + (i0 - left)]);
+            }
+        }
+    }
+
+    while (tiles.size() > capacity) {
+        cache.erase(tiles.back().key);
+        tiles.pop_back();
+    }
+}
+
+int Viewport::getWidth() const {
+    return width;
+}
+
+int Viewport::getHeight() const {
+    return height;
+}
+
+int Viewport::getZoom() const {
+    return level;
+}
+
+Coord Viewport::getCellSize() const {
+    return std::ldexp(Coord(1), -level);
+}
+
+Coord Viewport::getLeft() const {
+    return firstColumn() * getCellSize();
+}
+
+Coord Viewport::getTop() const {
+    return topRow() * getCellSize();
+}
+
+unsigned long Viewport::tilesRasterised() const {
+    return rasterised;
+}
+
+unsigned long Viewport::tilesReused() const {
+    return reused;
+}
+
+size_t Viewport::tilesCached() const {
+    return tiles.size();
+}
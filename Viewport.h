@@ -0,0 +1,102 @@
+#ifndef VIEWPORT_H_
+#define VIEWPORT_H_
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "Geometry.h"
+
+// Pan and zoom camera over a scene's world. The world is cut into a grid of
+// cells 2^-zoom world units across, cell (i, j) centred on world point
+// (i * cellSize, j * cellSize), and the grid into tiles of TILE x TILE
+// cells. Rendered tiles are kept in a least recently used cache, so a frame
+// only rasterises the tiles that panning has newly exposed or that a shape
+// has changed under since they were drawn. Those tiles take their shapes
+// from the scene's spatial index, and changes come from the scene's change
+// log, so a frame's cost does not grow with the size of the scene.
+class Viewport {
+
+public:
+	// A width x height view at zoom 0 whose bottom-left cell is centred on
+	// world point (0, 0), which is the view renderCoverage draws. At most
+	// capacity tiles are cached. If the view size is negative, samples is
+	// not between 1 and 8 or capacity is 0, throw a std::invalid_argument
+	// exception.
+	Viewport(int width, int height, int samples = 4, size_t capacity = 256);
+
+	// Move the view by (dx, dy) world units. Frames are drawn from the
+	// nearest whole cell, so cached tiles line up with the view.
+	void pan(Coord dx, Coord dy);
+
+	// Halve the cell size steps times (double it if steps is negative),
+	// keeping the centre of the view in place. If the zoom would leave
+	// MIN_ZOOM .. MAX_ZOOM, throw a std::invalid_argument exception.
+	void zoom(int steps);
+
+	// Store the covered fraction of every cell of the view, row by row from
+	// the top, of what operator<< would draw of s
+	void render(const Scene& s, std::vector<float>& coverage);
+
+	int getWidth() const;
+	int getHeight() const;
+	int getZoom() const;
+	Coord getCellSize() const;
+
+	// World point at the centre of the top-left cell of the next frame
+	Coord getLeft() const;
+	Coord getTop() const;
+
+	// Tiles rasterised, and tiles drawn from the cache, by render() so far
+	unsigned long tilesRasterised() const;
+	unsigned long tilesReused() const;
+
+	size_t tilesCached() const;
+
+	static constexpr int TILE = 32;
+	static constexpr int MIN_ZOOM = -16;
+	static constexpr int MAX_ZOOM = 8;
+
+	// More changed shapes than this in one frame empty the whole cache
+	// rather than checking every tile against every change
+	static constexpr size_t CLEAR_LIMIT = 64;
+
+private:
+	int width, height, samples;
+	size_t capacity;
+	int level;
+
+	// World point at the centre of the view
+	Coord x, y;
+
+	struct TileKey {
+		int zoom, tx, ty;
+
+		bool operator==(const TileKey& other) const;
+	};
+
+	struct TileKeyHash {
+		size_t operator()(const TileKey& key) const;
+	};
+
+	// Cells of tile (tx, ty), row by row from the top
+	struct Tile {
+		TileKey key;
+		std::vector<float> cells;
+	};
+
+	// Most recently used first
+	std::list<Tile> tiles;
+	std::unordered_map<TileKey, std::list<Tile>::iterator, TileKeyHash> cache;
+
+	ChangeTracker changes;
+	unsigned long rasterised, reused;
+
+	// Grid column of the left of the view and row of its top
+	int firstColumn() const;
+	int topRow() const;
+
+	// Drop the cached tiles that any of the changed bounds reach into
+	void invalidate(const std::vector<BoundingBox>& changed);
+};
+
+#endif /* VIEWPORT_H_ */